@@ -7,335 +7,3048 @@
 #ifndef ASYNC_H
 #define ASYNC_H
 
+#include <stdint.h>
+#if defined(ARDUINO_ARCH_AVR)
+#include <new.h> //placement new, for inline_function
+#else
+#include <new>
+#endif
+#if defined(__linux__) && !defined(ARDUINO)
+#include <time.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+#ifndef MAX_FUNCTIONARRAY_SIZE
 #define MAX_FUNCTIONARRAY_SIZE 32 //Arduino Unos can only handle up to 2KB of memory, which means that the allocate() function below will freeze the Arduino if it tries to allocate too much space
+#endif
+
+#ifndef ASYNC_TICKS_PER_US
+#define ASYNC_TICKS_PER_US 1 //native timer ticks per microsecond. Async stores all time internally in ticks
+#endif
+
+#if defined(ASYNC_FIBERS) && defined(__linux__) && !defined(ARDUINO)
+#define ASYNC_HAS_FIBERS
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+#ifndef ASYNC_FIBER_COUNT
+#define ASYNC_FIBER_COUNT 8 //fibers preallocated for functions that block; functions beyond this run without a fiber
+#endif
+#ifndef ASYNC_FIBER_STACK_SIZE
+#define ASYNC_FIBER_STACK_SIZE 16384 //bytes of stack for every fiber
+#endif
+#endif
+
+#if defined(ASYNC_SHARDS) && defined(__linux__) && !defined(ARDUINO)
+#define ASYNC_HAS_SHARDS
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#ifndef ASYNC_INLINE_SIZE
+#define ASYNC_INLINE_SIZE (4 * sizeof(void*)) //bytes of captured state an inline_function holds without the heap
+#endif
+
+#ifndef ASYNC_BATCH_SIZE
+#define ASYNC_BATCH_SIZE 8 //the most due functions a single wake up runs; the rest run in the batch right after it
+#endif
+
+#ifndef ASYNC_DAG_SUCCESSORS
+#define ASYNC_DAG_SUCCESSORS 4 //the most functions that can depend on a single dag_node
+#endif
+
+#ifndef ASYNC_MAX_SPIN
+#define ASYNC_MAX_SPIN 1000 //the most ticks HybridClock will spin before a deadline, which caps the CPU it burns on every wake up
+#endif
+
+typedef uint32_t tick_t; //a single machine word of time on the Arduino. micros() wraps around every ~71 minutes.
+
+/**
+ * Duration. An amount of time in a unit that is fixed at compile time, stored as a count of that unit.
+ * Converting to a finer unit (milliseconds -> microseconds -> ticks) is implicit and costs a multiplication by a constant.
+ * Converting to a coarser unit loses precision, so it must be asked for with duration_cast().
+ * Durations cannot be made implicitly from plain numbers, so mixing up units is a compile error.
+ **/
+template <tick_t TicksPerUnit>
+struct duration final {
+    public:
+        explicit duration(const tick_t count = 0) : m_count(count) {}
+
+        template <tick_t OtherTicksPerUnit>
+        duration(const duration<OtherTicksPerUnit>& other) : m_count(other.count() * (OtherTicksPerUnit / TicksPerUnit)) {
+            static_assert(OtherTicksPerUnit % TicksPerUnit == 0, "converting to a coarser unit loses precision; use duration_cast()");
+        }
+
+        const tick_t count() const { return m_count; }
+        const tick_t ticks() const { return m_count * TicksPerUnit; } //TicksPerUnit is a constant, so this never divides
+    private:
+        tick_t m_count;
+};
+
+typedef duration<1> ticks;
+typedef duration<ASYNC_TICKS_PER_US> microseconds;
+typedef duration<ASYNC_TICKS_PER_US * 1000UL> milliseconds;
+
+/*
+Converts between any two units, including to a coarser one (which rounds down). The divisor is a compile time constant.
+*/
+template <typename To, tick_t TicksPerUnit>
+const To duration_cast(const duration<TicksPerUnit>& other) {
+    return To(other.ticks() / ticks(To(1)).count());
+}
+
+/**
+ * Timestamp. A point in time that stays correct when micros() wraps around, by using serial number arithmetic (RFC 1982).
+ * Two timestamps can be compared as long as they are less than half the range (~35 minutes) apart.
+ * Every operation is a single 32-bit subtraction, so it is as cheap as comparing plain numbers.
+ **/
+struct timestamp final {
+    public:
+        timestamp(const tick_t time = 0) : value(time) {}
+
+        const bool operator<(const timestamp& other) const { return (int32_t)(value - other.value) < 0; }
+        const bool operator>(const timestamp& other) const { return other < *this; }
+        const bool operator<=(const timestamp& other) const { return !(other < *this); }
+        const bool operator>=(const timestamp& other) const { return !(*this < other); }
+        const bool operator==(const timestamp& other) const { return value == other.value; }
+        const bool operator!=(const timestamp& other) const { return value != other.value; }
+
+        const tick_t operator-(const timestamp& earlier) const { return value - earlier.value; } //time elapsed since earlier. Always correct, even across a wrap around.
+        const timestamp operator+(const tick_t time) const { return timestamp(value + time); }
+
+        template <tick_t TicksPerUnit>
+        const timestamp operator+(const duration<TicksPerUnit>& time) const { return timestamp(value + time.ticks()); }
+
+        tick_t value;
+};
+
+#ifdef ASYNC_HAS_FIBERS
+/**
+ * Fiber. A small stack that a function can run on, so that it can be suspended in the middle of a blocking call. Inside a
+ * fiber, wait(), delay() and delayMicroseconds() hand the CPU back to Async until the requested time has passed, instead of
+ * freezing the event loop. Fibers come from a fixed pool of ASYNC_FIBER_COUNT stacks of ASYNC_FIBER_STACK_SIZE bytes.
+ * On x86-64 a switch only saves the callee-saved registers (tens of nanoseconds); other Linux hosts use ucontext.
+ * Only available on Linux hosts, when ASYNC_FIBERS is defined before including this header.
+ **/
+struct fiber final {
+    void* context = nullptr; //the saved stack pointer of the fiber while it is suspended
+    void* caller = nullptr; //the saved stack pointer of the event loop while the fiber runs
+#if !defined(__x86_64__)
+    ucontext_t fiber_context;
+    ucontext_t caller_context;
+#endif
+    void (*entry)(fiber*) = nullptr;
+    void* task = nullptr; //where the function that owns the fiber currently lives
+    void* callable = nullptr; //the callable on the fiber stack, once done, for Async to move back into the function
+    unsigned long result = 0; //what the function returned, once done
+    unsigned long wait = 0; //how long the function asked to wait for, in microseconds, while suspended
+    bool done = false;
+    bool used = false;
+    alignas(16) unsigned char stack[ASYNC_FIBER_STACK_SIZE];
+};
+
+#if defined(__x86_64__)
+/*
+_fiber_switch(save, load): saves the callee-saved registers and the stack pointer into *save, then restores them from load.
+A new fiber starts in _fiber_start, which calls entry(fiber) with the two values planted in r12 and r13 by _fiber_prepare().
+The symbols live in a COMDAT section, so including this header in several files does not define them twice.
+*/
+extern "C" void _fiber_switch(void** save, void* load);
+extern "C" void _fiber_start();
+asm(R"(
+    .pushsection .text._fiber_switch,"axG",@progbits,_fiber_switch,comdat
+    .globl _fiber_switch
+    .globl _fiber_start
+    .type _fiber_switch, @function
+_fiber_switch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .type _fiber_start, @function
+_fiber_start:
+    movq %r12, %rdi
+    callq *%r13
+    ud2
+    .popsection
+)");
+
+inline void _fiber_prepare(fiber* f) {
+    void** top = (void**)(f->stack + ASYNC_FIBER_STACK_SIZE); //16-byte aligned, so the call in _fiber_start sees the usual alignment
+    *--top = (void*)&_fiber_start;
+    *--top = nullptr; //rbp
+    *--top = nullptr; //rbx
+    *--top = (void*)f; //r12
+    *--top = (void*)f->entry; //r13
+    *--top = nullptr; //r14
+    *--top = nullptr; //r15
+    f->context = top;
+}
+
+inline void _fiber_resume(fiber* f) {
+    _fiber_switch(&f->caller, f->context);
+}
+
+inline void _fiber_suspend(fiber* f) {
+    _fiber_switch(&f->context, f->caller);
+}
+#else
+inline fiber*& _fiber_starting() {
+    static thread_local fiber* f = nullptr; //makecontext() can only pass ints, so the fiber being started is handed over here
+    return f;
+}
+
+inline void _fiber_trampoline() {
+    fiber* f = _fiber_starting();
+    f->entry(f);
+}
+
+inline void _fiber_prepare(fiber* f) {
+    getcontext(&f->fiber_context);
+    f->fiber_context.uc_stack.ss_sp = f->stack;
+    f->fiber_context.uc_stack.ss_size = ASYNC_FIBER_STACK_SIZE;
+    f->fiber_context.uc_link = nullptr;
+    makecontext(&f->fiber_context, _fiber_trampoline, 0);
+}
+
+inline void _fiber_resume(fiber* f) {
+    _fiber_starting() = f;
+    swapcontext(&f->caller_context, &f->fiber_context);
+}
+
+inline void _fiber_suspend(fiber* f) {
+    swapcontext(&f->fiber_context, &f->caller_context);
+}
+#endif
+
+/*
+The fiber the current thread is running in, or nullptr while the event loop itself runs.
+*/
+inline fiber*& _fiber_current() {
+    static thread_local fiber* f = nullptr;
+    return f;
+}
+
+/*
+Takes a fiber from the pool, ready to call entry. Returns nullptr when every fiber is in use.
+*/
+inline fiber* _fiber_acquire(void (*entry)(fiber*)) {
+    static fiber pool[ASYNC_FIBER_COUNT];
+    for (int iii = 0; iii < ASYNC_FIBER_COUNT; iii++) {
+        if (!__atomic_test_and_set(&pool[iii].used, __ATOMIC_ACQUIRE)) {
+            pool[iii].entry = entry;
+            pool[iii].done = false;
+            _fiber_prepare(&pool[iii]);
+            return &pool[iii];
+        }
+    }
+    return nullptr;
+}
+
+inline void _fiber_release(fiber* f) {
+    __atomic_clear(&f->used, __ATOMIC_RELEASE);
+}
+
+/*
+Suspends the current fiber for time microseconds. Returns false (and does nothing) outside of a fiber.
+*/
+inline bool _fiber_wait(const unsigned long time) {
+    fiber* f = _fiber_current();
+    if (!f)
+        return false;
+
+    f->wait = time;
+    _fiber_current() = nullptr;
+    _fiber_suspend(f);
+    return true;
+}
+#endif
+
+/*
+Function created to switch between microseconds and millseconds delay().
+Note that delayMicroseconds() is accurate only up to 16383us, so longer waits are done in chunks of 16383us (which also avoids dividing by 1000).
+*/
+void wait(unsigned long time, const bool microseconds = true) {
+#ifdef ASYNC_HAS_FIBERS
+    if (_fiber_wait(microseconds ? time : time * 1000))
+        return; //the event loop kept running, and has resumed this fiber after time
+#endif
+    if (!microseconds) {
+        delay(time);
+        return;
+    }
+
+    while (time > 16383) { //Arduino can only accurate delay 16383 microseconds.
+        delayMicroseconds(16383);
+        time -= 16383;
+    }
+    delayMicroseconds(time);
+}
+
+#if defined(ASYNC_HAS_FIBERS) && !defined(ASYNC_NO_DELAY_HOOK)
+#define delay(time) wait((time), false) //blocking library code compiled after this header yields inside fibers too
+#define delayMicroseconds(time) wait((time))
+#endif
+
+/**
+ * Clock policies. Async reads the time and idles through a clock policy, which must provide:
+ *      static tick_t now();                  //the current time in ticks
+ *      static void sleep(const tick_t time); //idles for the given amount of ticks
+ * ArduinoClock: The default clock policy; real time through micros() and wait().
+ * ExtendedClock: Wraps another clock policy, and additionally counts the wrap arounds in software to give a 64-bit time through now64().
+ *                now64() must be called at least once every ~71 minutes; Async does this every time it reads the clock.
+ * HostClock: Real time on a Linux host, through clock_gettime() and nanosleep().
+ * HybridClock: Wraps another clock policy. Sleeps until shortly before the deadline, then spins on the clock for the rest, so
+ *              functions run on time instead of whenever the OS or delay() wakes up. The spin margin calibrates itself from
+ *              how late the wrapped clock wakes up, and never exceeds set_max_spin(). Do not wrap VirtualClock with it.
+ * VirtualClock: Time only moves when the event loop sleeps, and sleeping jumps the clock straight to the deadline. Tasks
+ *               always take zero time, so a run is bit-identical every time and finishes as fast as the CPU allows.
+ *               Define ASYNC_VIRTUAL_MICROS before including this header to make micros() in task code read the virtual time.
+ **/
+struct ArduinoClock final {
+    static tick_t now() {
+        return micros() * ASYNC_TICKS_PER_US;
+    }
+
+    static void sleep(const tick_t time) {
+        wait(time / ASYNC_TICKS_PER_US);
+    }
+};
+
+#if defined(__linux__) && !defined(ARDUINO)
+struct HostClock final {
+    static tick_t now() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (tick_t)ts.tv_sec * 1000000UL * ASYNC_TICKS_PER_US + (tick_t)(ts.tv_nsec / (1000 / ASYNC_TICKS_PER_US));
+    }
+
+    static void sleep(const tick_t time) {
+        const unsigned long us = time / ASYNC_TICKS_PER_US;
+        timespec ts;
+        ts.tv_sec = us / 1000000UL;
+        ts.tv_nsec = (us % 1000000UL) * 1000;
+        while (nanosleep(&ts, &ts) != 0) {} //resumes after signals
+    }
+};
+#endif
+
+template <typename Clock>
+struct HybridClock final {
+    static tick_t now() {
+        return Clock::now();
+    }
+
+    static void sleep(const tick_t time) {
+        const timestamp begin = Clock::now();
+        const timestamp deadline = begin + time;
+        const tick_t margin = state().margin;
+
+        if (time > margin) {
+            const tick_t requested = time - margin;
+            Clock::sleep(requested);
+
+            tick_t slept = timestamp(Clock::now()) - begin;
+            calibrate(slept > requested ? slept - requested : 0); //only oversleeping matters; waking up early is covered by the spin
+        }
+
+        while (timestamp(Clock::now()) < deadline); //spins for the final stretch
+    }
+
+    static void set_max_spin(const tick_t time) {
+        state().max_spin = time;
+        if (state().margin > time) state().margin = time;
+    }
+
+    static const tick_t margin() {
+        return state().margin;
+    }
+private:
+    struct calibration {
+        tick_t margin = ASYNC_MAX_SPIN; //starts pessimistic, and shrinks as wake ups are measured
+        tick_t max_spin = ASYNC_MAX_SPIN;
+        tick_t average = 0; //average oversleep, scaled by 8
+        tick_t deviation = 0; //mean deviation of the oversleep, scaled by 4
+    };
+
+    static calibration& state() {
+        static calibration c;
+        return c;
+    }
+
+    /*
+    Same estimator as the TCP retransmission timer (RFC 6298): margin = average + 4 * deviation, with shifts instead of divides.
+    */
+    static void calibrate(const tick_t error) {
+        calibration& c = state();
+        const tick_t average = c.average >> 3;
+        const tick_t difference = error > average ? error - average : average - error;
+
+        c.average += error - average; //average = 7/8 average + 1/8 error
+        c.deviation += difference - (c.deviation >> 2); //deviation = 3/4 deviation + 1/4 difference
+
+        const tick_t margin = (c.average >> 3) + c.deviation;
+        c.margin = margin < c.max_spin ? margin : c.max_spin;
+    }
+};
+
+template <typename Clock>
+struct ExtendedClock final {
+    static tick_t now() {
+        return now64(); //keeps the high word up to date on every read
+    }
+
+    static void sleep(const tick_t time) {
+        Clock::sleep(time);
+    }
+
+    static uint64_t now64() {
+        tick_t time = Clock::now();
+        if (time < last()) high()++; //the 32-bit clock wrapped around since the last read
+        last() = time;
+        return ((uint64_t)high() << 32) | time;
+    }
+private:
+    static tick_t& last() {
+        static tick_t time = 0;
+        return time;
+    }
+
+    static uint32_t& high() {
+        static uint32_t wraps = 0;
+        return wraps;
+    }
+};
+
+struct VirtualClock final {
+    static tick_t now() {
+        return current();
+    }
+
+    static void sleep(const tick_t time) {
+        current() += time; //jumps straight to the deadline
+    }
+
+    static void set(const tick_t time) {
+        current() = time;
+    }
+private:
+    static tick_t& current() {
+        static tick_t time = 0; //function-local so that the header can be included by many translation units
+        return time;
+    }
+};
+
+#ifdef ASYNC_VIRTUAL_MICROS
+#define micros() VirtualClock::now()
+#endif
+
+/*
+The swap function. It is just more elegant to swap with a single swap() function than writing the temporary variables, and then exchanging their variables over and over
+again.
+*/
+template <typename T> struct _remove_reference { typedef T type; };
+template <typename T> struct _remove_reference<T&> { typedef T type; };
+template <typename T> struct _remove_reference<T&&> { typedef T type; };
+
+/*
+The move and forward functions. The Arduino toolchain has no <utility>, so these stand in for std::move() and std::forward().
+*/
+template <typename T>
+typename _remove_reference<T>::type&& _move(T&& value) {
+    return static_cast<typename _remove_reference<T>::type&&>(value);
+}
+
+template <typename T>
+T&& _forward(typename _remove_reference<T>::type& value) {
+    return static_cast<T&&>(value);
+}
+
+template <typename T>
+void _swap(T& first, T& other) {
+    T tmp = _move(first);
+    first = _move(other);
+    other = _move(tmp);
+}
+
+/*
+Kernels over the delay array. On x86 hosts built with AVX2 or SSE4.1 they compare and subtract 8 or 4 delays at a time without
+branching; everywhere else (and for the leftover elements) they fall back to plain loops.
+_min_index:         index of the first smallest delay in [begin, end). begin must be less than end.
+_find_due:          writes the index of every delay that is at most limit into due, and returns how many there were.
+_subtract_saturate: subtracts offset from every delay, stopping at zero instead of wrapping around. Delays of ~0 mark functions that
+                    are not waiting for time (finished, running or parked), and are left as they are.
+*/
+inline int _min_index(const tick_t* delays, int begin, int end) {
+    int iii = begin;
+    tick_t smallest = ~(tick_t)0;
+#if defined(__AVX2__)
+    __m256i smallest8 = _mm256_set1_epi32(-1);
+    for (; iii + 8 <= end; iii += 8)
+        smallest8 = _mm256_min_epu32(smallest8, _mm256_loadu_si256((const __m256i*)(delays + iii)));
+    __m128i smallest4 = _mm_min_epu32(_mm256_castsi256_si128(smallest8), _mm256_extracti128_si256(smallest8, 1));
+#elif defined(__SSE4_1__)
+    __m128i smallest4 = _mm_set1_epi32(-1);
+    for (; iii + 4 <= end; iii += 4)
+        smallest4 = _mm_min_epu32(smallest4, _mm_loadu_si128((const __m128i*)(delays + iii)));
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__)
+    smallest4 = _mm_min_epu32(smallest4, _mm_shuffle_epi32(smallest4, _MM_SHUFFLE(1, 0, 3, 2)));
+    smallest4 = _mm_min_epu32(smallest4, _mm_shuffle_epi32(smallest4, _MM_SHUFFLE(2, 3, 0, 1)));
+    smallest = (tick_t)_mm_cvtsi128_si32(smallest4);
+#endif
+    for (; iii < end; iii++)
+        smallest = delays[iii] < smallest ? delays[iii] : smallest;
+
+    iii = begin;
+#if defined(__SSE4_1__) || defined(__AVX2__)
+    const __m128i target = _mm_set1_epi32((int)smallest);
+    for (; iii + 4 <= end; iii += 4) {
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(delays + iii)), target)));
+        if (mask) return iii + __builtin_ctz(mask);
+    }
+#endif
+    for (; iii < end; iii++)
+        if (delays[iii] == smallest) return iii;
+
+    return begin; //never reached
+}
+
+inline int _find_due(const tick_t* delays, int size, tick_t limit, int* due) {
+    int count = 0;
+    int iii = 0;
+#if defined(__AVX2__)
+    const __m256i limit8 = _mm256_set1_epi32((int)limit);
+    for (; iii + 8 <= size; iii += 8) {
+        __m256i values = _mm256_loadu_si256((const __m256i*)(delays + iii));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_min_epu32(values, limit8), values)));
+        while (mask) {
+            due[count++] = iii + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+#endif
+#if defined(__SSE4_1__) || defined(__AVX2__)
+    const __m128i limit4 = _mm_set1_epi32((int)limit);
+    for (; iii + 4 <= size; iii += 4) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(delays + iii));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_min_epu32(values, limit4), values)));
+        while (mask) {
+            due[count++] = iii + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; iii < size; iii++) {
+        due[count] = iii;
+        count += delays[iii] <= limit; //branch-free
+    }
+    return count;
+}
+
+inline void _subtract_saturate(tick_t* delays, int size, tick_t offset) {
+    int iii = 0;
+#if defined(__AVX2__)
+    const __m256i offset8 = _mm256_set1_epi32((int)offset);
+    const __m256i never8 = _mm256_set1_epi32(-1);
+    for (; iii + 8 <= size; iii += 8) {
+        __m256i values = _mm256_loadu_si256((const __m256i*)(delays + iii));
+        __m256i result = _mm256_sub_epi32(_mm256_max_epu32(values, offset8), offset8);
+        _mm256_storeu_si256((__m256i*)(delays + iii), _mm256_or_si256(result, _mm256_cmpeq_epi32(values, never8)));
+    }
+#endif
+#if defined(__SSE4_1__) || defined(__AVX2__)
+    const __m128i offset4 = _mm_set1_epi32((int)offset);
+    const __m128i never4 = _mm_set1_epi32(-1);
+    for (; iii + 4 <= size; iii += 4) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(delays + iii));
+        __m128i result = _mm_sub_epi32(_mm_max_epu32(values, offset4), offset4);
+        _mm_storeu_si128((__m128i*)(delays + iii), _mm_or_si128(result, _mm_cmpeq_epi32(values, never4)));
+    }
+#endif
+    for (; iii < size; iii++) {
+        if (delays[iii] != ~(tick_t)0)
+            delays[iii] -= delays[iii] < offset ? delays[iii] : offset; //checks if the delay can be subtracted without undesirable consequence (like overflowing).
+    }
+}
+
+
+/**
+ * Inline function. A callable that holds a capturing lambda or functor inside itself, so that every function in Async can carry
+ * its own state without globals and without the heap. Use it as F:
+ *      Async<inline_function<>> async;
+ *      async.emplace([count](unsigned long step, unsigned long id) mutable { return ++count < 10 ? 1000 : 0; });
+ * Calls go through a single function pointer; copying, moving and destroying the callable go through a second one.
+ * Callables must be copyable, at most Size bytes, and are called with (step, id), returning the delay like any function.
+ **/
+template <unsigned Size = ASYNC_INLINE_SIZE>
+struct inline_function final {
+    public:
+        inline_function()=default;
+        inline_function(decltype(nullptr)) {}
+        template <typename C>
+        inline_function(C callable);
+        ~inline_function();
+
+        inline_function(const inline_function& other);
+        inline_function(inline_function&& other);
+        inline_function& operator=(const inline_function& other);
+        inline_function& operator=(inline_function&& other);
+        inline_function& operator=(decltype(nullptr));
+
+        explicit operator bool() const { return m_invoke != nullptr; }
+        unsigned long operator()(unsigned long step, unsigned long id) { return m_invoke(&m_storage, step, id); }
+    private:
+        union storage {
+            unsigned char bytes[Size];
+            long double align_float; //aligns the buffer for anything a callable may capture
+            long long align_integer;
+            void* align_pointer;
+        } m_storage;
+        unsigned long (*m_invoke)(void* callable, unsigned long step, unsigned long id) = nullptr;
+        void (*m_manage)(void* callable, void* other, bool copy) = nullptr; //copies or moves other into callable; destroys callable if other is nullptr
+
+        template <typename C>
+        static unsigned long invoke(void* callable, unsigned long step, unsigned long id);
+        template <typename C>
+        static void manage(void* callable, void* other, bool copy);
+};
+
+template <unsigned Size>
+template <typename C>
+inline_function<Size>::inline_function(C callable) {
+    static_assert(sizeof(C) <= Size, "the callable does not fit into inline_function; raise ASYNC_INLINE_SIZE or the Size parameter");
+    static_assert(alignof(C) <= alignof(storage), "the callable needs a stricter alignment than inline_function provides");
+
+    new (&m_storage) C(_move(callable));
+    m_invoke = &invoke<C>;
+    m_manage = &manage<C>;
+}
+
+template <unsigned Size>
+inline_function<Size>::~inline_function() {
+    *this = nullptr;
+}
+
+template <unsigned Size>
+inline_function<Size>::inline_function(const inline_function& other) {
+    *this = other;
+}
+
+template <unsigned Size>
+inline_function<Size>::inline_function(inline_function&& other) {
+    *this = _move(other);
+}
+
+template <unsigned Size>
+inline_function<Size>& inline_function<Size>::operator=(const inline_function& other) {
+    if (this == &other)
+        return *this;
+
+    *this = nullptr;
+    if (other.m_manage)
+        other.m_manage(&m_storage, (void*)&other.m_storage, true);
+    m_invoke = other.m_invoke;
+    m_manage = other.m_manage;
+    return *this;
+}
+
+template <unsigned Size>
+inline_function<Size>& inline_function<Size>::operator=(inline_function&& other) {
+    if (this == &other)
+        return *this;
+
+    *this = nullptr;
+    if (other.m_manage)
+        other.m_manage(&m_storage, &other.m_storage, false);
+    m_invoke = other.m_invoke;
+    m_manage = other.m_manage;
+    other = nullptr;
+    return *this;
+}
+
+template <unsigned Size>
+inline_function<Size>& inline_function<Size>::operator=(decltype(nullptr)) {
+    if (m_manage)
+        m_manage(&m_storage, nullptr, false);
+    m_invoke = nullptr;
+    m_manage = nullptr;
+    return *this;
+}
+
+template <unsigned Size>
+template <typename C>
+unsigned long inline_function<Size>::invoke(void* callable, unsigned long step, unsigned long id) {
+    return (*(C*)callable)(step, id);
+}
+
+template <unsigned Size>
+template <typename C>
+void inline_function<Size>::manage(void* callable, void* other, bool copy) {
+    if (!other)
+        ((C*)callable)->~C();
+    else if (copy)
+        new (callable) C(*(const C*)other);
+    else new (callable) C(_move(*(C*)other));
+}
+
+/**
+ * Task traits. The types of the delay, step and id that every function carries, and how many bits of each are kept.
+ * Each slot of an Async holds a function and its 4-byte delay in m_delays. For a plain function pointer, per slot:
+ *                                      AVR                 x86-64
+ *      task_traits                     21 (17 + 4)         44 (40 + 4)
+ *      packed_traits<10, 6, 16>        13 (9 + 4)          28 (24 + 4)
+ * A function links a group, a rate limit, a timing contract or a DAG node directly. Only one that has more than one of them
+ * takes a side record (10 bytes on an AVR, 40 on x86-64), which copies share; ASYNC_FIBERS adds a pointer to every function.
+ * Async keeps its own 32-bit delays next to the functions, so only the delay of a function that is not in an Async yet is
+ * limited by the traits, and the delay kernels above stay as they are. Inside an Async the delay field only serves get(),
+ * which is why a narrow TimeBits costs the least.
+ *      compact_traits<Step, Id, Time>:               plain fields of the given types; task_traits is the default (unsigned long,
+ *                                                    unsigned long, tick_t).
+ *      packed_traits<StepBits, IdBits, TimeBits>:    bitfields of a single 32-bit word, for example packed_traits<10, 6, 16>.
+ * Steps wrap around to 0 once they outgrow their field, ids are truncated, and delays saturate at the largest one that fits.
+ **/
+template <typename Step, typename Id, typename Time>
+struct compact_traits final {
+    typedef Step step_type;
+    typedef Id id_type;
+    typedef Time time_type;
+    static const int STEP_BITS = sizeof(Step) * 8;
+    static const int ID_BITS = sizeof(Id) * 8;
+    static const int TIME_BITS = sizeof(Time) * 8;
+};
+
+template <int StepBits, int IdBits, int TimeBits>
+struct packed_traits final {
+    static_assert(StepBits + IdBits + TimeBits <= 32, "packed fields must fit into 32 bits");
+
+    typedef uint32_t step_type;
+    typedef uint32_t id_type;
+    typedef uint32_t time_type;
+    static const int STEP_BITS = StepBits;
+    static const int ID_BITS = IdBits;
+    static const int TIME_BITS = TimeBits;
+};
+
+typedef compact_traits<unsigned long, unsigned long, tick_t> task_traits;
+
+template <typename F, typename Clock, typename Traits> struct Async;
+template <typename F, typename Traits> struct task_group;
+template <typename F, typename Traits> struct dag_node;
+
+/**
+ * Token bucket. Limits how often the functions sharing it can run: one token is earned every interval, up to burst tokens are
+ * saved up, and every run spends one. Async pushes a function back until a token is available, so bursts of wake ups are
+ * spread out before they reach the queue. A bucket with a burst of 1 is a plain throttle.
+ * Implemented as the generic cell rate algorithm (GCRA), which only needs a single timestamp instead of a token count.
+ **/
+struct token_bucket final {
+    public:
+        template <tick_t TicksPerUnit>
+        token_bucket(const duration<TicksPerUnit>& interval, const tick_t burst = 1) : interval(interval.ticks()), tolerance(interval.ticks() * (burst - 1)) {}
+
+        const tick_t delay_for(const timestamp when) const; //how long after when the next token can be spent
+        void take(const timestamp when); //spends a token at when, which must be at least delay_for(when) away
+    private:
+        tick_t interval;
+        tick_t tolerance; //how far ahead of schedule the bucket allows, which is what lets tokens be saved up
+        timestamp arrival; //the theoretical arrival time of the next token
+        bool started = false;
+};
+
+inline const tick_t token_bucket::delay_for(const timestamp when) const {
+    timestamp earliest = timestamp(arrival.value - tolerance);
+    if (!started || when >= earliest)
+        return 0;
+
+    return earliest - when;
+}
+
+inline void token_bucket::take(const timestamp when) {
+    arrival = (started && arrival > when ? arrival : when) + interval;
+    started = true;
+}
+
+/**
+ * Task timing. The timing contract of a function, shared through a pointer so that functions without one pay nothing for it.
+ * deadline: How long after its release (the moment its delay runs out) the function must have returned. 0 means no deadline.
+ *           In earliest-deadline-first mode (Async::set_edf()) due functions run in order of their absolute deadlines.
+ * on_miss:  Called with the id of the function and how late it finished, whenever it returns after its deadline.
+ * period:   For periodic functions, how often the function is released. Together with wcet (its worst case execution time),
+ *           this lets Async::set_admission() check at add() time whether every periodic function can meet its deadline.
+ *           Periodic functions without a deadline must finish before their next release.
+ * slack:    How much later than its delay the function may run. With Async::set_coalescing(), the loop sleeps until the end of
+ *           the earliest slack window, so every function whose window is open by then shares one wake up.
+ **/
+struct task_timing final {
+    public:
+        task_timing()=default;
+
+        template <tick_t TicksPerUnit>
+        task_timing(const duration<TicksPerUnit>& deadline, void (*on_miss)(unsigned long id, tick_t lateness) = nullptr) : deadline(deadline.ticks()), on_miss(on_miss) {}
+
+        template <tick_t PeriodTicksPerUnit, tick_t WcetTicksPerUnit>
+        task_timing(const duration<PeriodTicksPerUnit>& period, const duration<WcetTicksPerUnit>& wcet) : period(period.ticks()), wcet(wcet.ticks()) {}
+
+        const tick_t relative_deadline() const { return deadline > 0 && (deadline < period || period == 0) ? deadline : period; }
+
+        tick_t deadline = 0; //in ticks
+        void (*on_miss)(unsigned long id, tick_t lateness) = nullptr;
+        tick_t period = 0; //in ticks; 0 for functions that are not periodic
+        tick_t wcet = 0; //in ticks
+        tick_t slack = 0; //in ticks
+};
+
+/*
+What Async::add() did with a function.
+ASYNC_OK:            Added.
+ASYNC_FULL:          Not added, there are already MAX_FUNCTIONARRAY_SIZE functions.
+ASYNC_UNSCHEDULABLE: Not added, the periodic functions could not all meet their deadlines with it (see Async::set_admission()).
+ASYNC_OVERLOADED:    Added, but the periodic functions can no longer all meet their deadlines.
+*/
+enum async_status {
+    ASYNC_OK = 0,
+    ASYNC_FULL,
+    ASYNC_UNSCHEDULABLE,
+    ASYNC_OVERLOADED
+};
+
+/*
+The schedulability test Async::add() runs for periodic functions.
+ADMIT_ANY:            No test.
+ADMIT_RATE_MONOTONIC: Fixed priorities, shortest deadline first. Exact response time analysis.
+ADMIT_EDF:            Earliest deadline first. Total density (wcet over the smaller of deadline and period) of at most 1,
+                      which is exact when deadlines equal periods.
+*/
+enum async_admission {
+    ADMIT_ANY = 0,
+    ADMIT_RATE_MONOTONIC,
+    ADMIT_EDF
+};
+
+/**
+ * Park slot. Where a function that is parked (waiting for an event, such as data on a channel, rather than for time) can be
+ * found again. Async keeps the slot up to date as the function moves around its task list, so waking it up is O(1):
+ *      return async.park(slot); //inside the function: do not run again until async.wake(slot)
+ *      async.wake(slot);        //anywhere in the same event loop: the parked function is due right away
+ * A slot holds at most one function at a time.
+ **/
+struct park_slot final {
+    public:
+        park_slot()=default;
+        park_slot(const park_slot&)=delete;
+
+        const bool waiting() const { return index >= 0; } //whether a function is parked in the slot
+    private:
+        int index = -1; //the index of the parked function in Async
+        park_slot* next = nullptr; //the next slot Async has a function parked in
+
+        template <typename, typename, typename> friend struct Async;
+};
+
+/**
+ * Function. This structure can wrap any kind of function, which is used by Async to call functions. Return value is ignored, as we are not using futures/promises (too much work for an Arduino project)
+ * F only needs to be copyable if the function is copied; move-only callables can be moved in, moved around and emplaced.
+ **/
+template <typename F, typename Traits = task_traits>
+struct function final {
+    public:
+        function();
+        function(F func);
+        ~function();
+
+        function(const function<F, Traits>&);
+        function(function<F, Traits>&&);
+
+        template <class ... Args>
+        void emplace(Args&& ... args); //replaces the wrapped function with one constructed from args, and resets the delay, step and id
+
+        const unsigned long get_delay(bool microseconds = true) const; //kept for compatibility; prefer the typed versions below
+        void set_delay(unsigned long delay, bool microseconds = true);
+
+        template <typename Unit>
+        const Unit get_delay() const;
+        template <tick_t TicksPerUnit>
+        void set_delay(const duration<TicksPerUnit>& delay);
+
+        const tick_t get_ticks() const; //the delay in native ticks, as used by Async
+        void set_ticks(tick_t delay);
+
+        const unsigned long getStep() const;
+        void setStep(unsigned long newSize); 
+
+        const unsigned long getId() const;
+        void setId(unsigned long newId);
+
+        //The setters below return false if the function already has one of the others, and there is no memory for the side
+        //record that holds both (see m_link)
+        task_group<F, Traits>* getGroup() const;
+        bool setGroup(task_group<F, Traits>* newGroup); //the group this function counts towards when it is added to Async
+
+        token_bucket* getRateLimit() const;
+        bool setRateLimit(token_bucket* newBucket); //limits how often the function runs. Share a bucket to limit several functions (or every function of an id) together
+
+        task_timing* getTiming() const;
+        bool setTiming(task_timing* newTiming); //the deadline of the function; see task_timing
+
+        const bool getFiber() const;
+        void setFiber(bool useFiber); //runs the function on its own fiber (when ASYNC_FIBERS is enabled), so that wait() and delay() inside it do not block Async
+
+        void operator=(const function<F, Traits>&);
+        void operator=(function<F, Traits>&&);
+        const bool operator==(const function<F, Traits>&) const;
+        
+        void swap(function<F, Traits>&);
+        
+        template<typename R, class ... Tn>
+        R run(Tn ... args);
+    private:
+        F m_func = nullptr; //sets the function to nullptr
+        unsigned char flags = 0; //the state of the function within Async, and what m_link points to. Kept ahead of the fields below, so that it fits into their padding
+        typename Traits::time_type delay_ticks : Traits::TIME_BITS; //amount of time needed to be delayed, in ticks
+        typename Traits::step_type step : Traits::STEP_BITS; //the number of steps it has done
+        typename Traits::id_type id : Traits::ID_BITS; //the id of the function; useful for functions that only want the latest version of itself to run
+
+        //The group, rate limit, timing contract or dag_node of the function. Most functions have none of them, and most of the
+        //rest have one, which m_link points to directly. Only a function with more than one points to a side record. Copies
+        //share the record, and copy it only when one of them changes a link.
+        struct extras final {
+            void* links[4] = {}; //indexed by the kind of link, minus 1
+            int references = 1;
+        };
+        void* m_link = nullptr;
+#ifdef ASYNC_HAS_FIBERS
+        fiber* running_fiber = nullptr; //the fiber the function is suspended in, if any
+#endif
+
+        static const unsigned char FINISHED = 1; //returned 0, and waits for Async to remove it
+        static const unsigned char RUNNING = 2; //Async is running it right now
+        static const unsigned char FIBER = 4; //runs on a fiber
+        static const unsigned char PARKED = 8; //waits for Async::wake() instead of for time
+        static const unsigned char SLOT = 16; //has a park_slot, which Async keeps in its list of waiting slots
+        static const unsigned char LINK_SHIFT = 5; //the top three bits of flags tell what m_link points to
+        static const unsigned char LINK_MASK = 7 << LINK_SHIFT;
+        static const unsigned char LINK_GROUP = 1;
+        static const unsigned char LINK_BUCKET = 2;
+        static const unsigned char LINK_TIMING = 3;
+        static const unsigned char LINK_NODE = 4;
+        static const unsigned char LINK_EXTRAS = 5;
+        static const tick_t MAX_TICKS = Traits::TIME_BITS < 32 ? ((tick_t)1 << (Traits::TIME_BITS % 32)) - 1 : ~(tick_t)0; //the longest delay the function can hold
+
+        void* getLink(unsigned char kind) const;
+        bool setLink(unsigned char kind, void* value);
+        void clearLinks(); //drops every link, and the side record with them
+        void swapState(function<F, Traits>& other); //swaps everything but the callable, which may be running
+        dag_node<F, Traits>* getNode() const;
+        bool setNode(dag_node<F, Traits>* newNode);
+
+        template <typename, typename, typename> friend struct Async;
+        template <typename, typename> friend struct dag_node;
+};
+
+/**
+ * Task group. Counts how many of its functions are still in an Async, so that work can wait for all of them to finish.
+ * Functions join when added with Async::add(fw, group), and leave when they return 0 or are removed; both are O(1).
+ * There are two ways to wait for a group to empty:
+ *      async.run_until_complete(group);  //runs the event loop (even from inside another function) until the group is empty
+ *      group.then(continuation);         //adds continuation into the Async as soon as the last function leaves
+ * If the Async is full at that point, the continuation is added at the end of a later batch instead, and counts towards size()
+ * until then.
+ **/
+template <typename F, typename Traits = task_traits>
+struct task_group final {
+    public:
+        task_group()=default;
+        task_group(const task_group&)=delete;
+
+        void then(function<F, Traits>&& continuation);
+        void then(const function<F, Traits>& continuation);
+        const int size() const; //how many functions in the group are still running
+    private:
+        int pending = 0;
+        bool has_continuation = false;
+        function<F, Traits> continuation;
+        task_group* next_stalled = nullptr; //the next group whose continuation waits for room in the same Async
+
+        template <typename, typename, typename> friend struct Async;
+};
+
+/**
+ * DAG node. A function that is only added into an Async once all of the nodes it comes after have finished (returned 0 or been
+ * removed), for pipelines such as sensors -> filter -> fuse -> plan:
+ *      dag_node<F> read{function<F>(read_sensors)}, filter{function<F>(run_filter)}, plan{function<F>(make_plan)};
+ *      filter.after(read);
+ *      plan.after(filter);
+ *      async.add(read); //nodes without predecessors are added directly; the rest are added by the last predecessor to finish
+ * Every node counts its unfinished predecessors down, and knows its successors, so nothing is ever polled or scanned.
+ * With ASYNC_SHARDS the countdown is atomic, and ShardedAsync::submit(node) hands every node released after it to the least
+ * loaded shard (through set_release()), so that independent branches run on different cores. Nodes run once; they must outlive the functions they hold.
+ * A node released while the Async is full is added at the end of a later batch instead.
+ **/
+template <typename F, typename Traits = task_traits>
+struct dag_node final {
+    public:
+        dag_node(function<F, Traits> fw);
+        dag_node(const dag_node&)=delete;
+
+        bool after(dag_node& predecessor); //runs this node only after predecessor has finished. Returns false if predecessor has ASYNC_DAG_SUCCESSORS already
+        void set_release(bool (*release)(function<F, Traits>&& fw, void* context), void* context); //where released nodes go, instead of the Async their last predecessor ran in
+        const int pending() const; //how many predecessors have not finished yet
+    private:
+        function<F, Traits> task;
+        int m_pending = 0;
+        int m_successors = 0;
+        dag_node* successors[ASYNC_DAG_SUCCESSORS];
+        bool (*release)(function<F, Traits>&& fw, void* context) = nullptr;
+        void* context = nullptr;
+        dag_node* next_stalled = nullptr; //the next node that waits for room in the same Async
+
+        template <typename, typename, typename> friend struct Async;
+#ifdef ASYNC_HAS_SHARDS
+        template <typename, int, unsigned> friend struct ShardedAsync;
+#endif
+};
+
+/**
+ * Async structure. Async allows functions to run (almost) simultaneously.
+ * Permanent functions: Permanent functions will remain on the async event loop forever.
+ *                      This means that for every call to run_until_complete(), permanent functions will run.
+ *                      The order in which permanent functions are added is the order the functions will run sequentially within the event loop
+ * Normal functions: Normal functions will be removed from the event loop after a single call to run_until_complete()
+ * Reason for not using shared pointers: Most likely never going to call getAll() or getAll_Permanent().
+ * Clock: The clock policy used to read the time and to idle between functions. See ArduinoClock and VirtualClock.
+ * Storage: The delays are kept in their own array (m_delays), apart from the functions (tasks). Sorting and offsetting only ever
+ *          read the delays, so they do not drag the function pointers, steps and ids through the cache. The delay stored inside
+ *          each function in tasks is only brought up to date by get() and getAll().
+ * Batches: Every wake up runs all of the functions that are due, most overdue first, and then pays for offsetting the delays
+ *          and removing finished functions only once. The event loop never needs to sort the tasks. The delay a function returns
+ *          still counts from when it started, so the functions that ran before it in the batch do not shorten it.
+ **/
+template <typename F, typename Clock = ArduinoClock, typename Traits = task_traits>
+struct Async final {
+public:
+    Async();
+    ~Async();
+
+    Async(const Async&)=delete;
+    Async(Async&&)=delete;
+
+    void run_until_complete();
+    void run_until_complete(task_group<F, Traits>& group); //runs until every function in group has finished. Can be called from inside a function
+
+    /*
+    Non-blocking use, for when another loop (such as Arduino's loop(), or an event loop on a host) owns the CPU. Nothing here
+    ever calls Clock::sleep() except run_until()/run_for(), so the caller decides how to idle:
+        void loop() { async.run_once(); otherLibrary.update(); }
+    */
+    unsigned long run_once(); //runs whatever is due, without waiting. Returns the microseconds until the next function is due, or ~0UL if none is waiting for time
+    void run_until(timestamp deadline); //runs functions as they come due until deadline, or until none is waiting for time
+    template <tick_t TicksPerUnit>
+    void run_for(const duration<TicksPerUnit>& time); //run_until() for a while from now
+    void offsetDelayBy(tick_t offsetDelay); //offsets all the delay in the array, in ticks
+
+    /*
+    Cooperative yielding for functions that take a long time. Check should_yield() every so often, and when it is true, save
+    the progress and return yield_point(); the function then continues right after the more urgent functions have run:
+        if (async.should_yield()) return async.yield_point();
+    */
+    bool should_yield(); //whether another function is due. Costs a clock read, plus one scan of the delays on the first call
+    unsigned long yield_point(); //the delay (in microseconds) to return to continue right after the functions that are due
+
+    unsigned long park(park_slot& slot); //parks the running function in slot once it returns this, instead of a delay
+    bool wake(park_slot& slot); //makes the function parked in slot due right away. Returns false if nothing was parked
+
+    void set_edf(bool edf); //orders due functions by absolute deadline (earliest first) instead of by how overdue they are
+    const unsigned long misses() const; //how many times a function returned after its deadline, since the last reset_stats()
+    void set_coalescing(bool coalesce); //lets functions with slack (see task_timing) run late, so that fewer wake ups are needed
+    const unsigned long wakeups() const; //how many times the loop went to sleep, since the last reset_stats()
+
+    const tick_t lateness() const; //how late (in ticks) the last function started after its delay ran out
+    const tick_t max_lateness() const; //the worst lateness since the last reset_stats(). Time is always charged from the clock, so lateness never builds up across functions
+    void reset_stats();
+    async_status add(const function<F, Traits>& fw); //adds a normal function
+    async_status add(function<F, Traits>&& fw); //adds a normal function without copying it
+    async_status add(function<F, Traits> fw, task_group<F, Traits>& group); //adds a normal function as a member of group
+    async_status add(dag_node<F, Traits>& node); //adds the function of node, unless it still waits for a predecessor; see dag_node
+
+    void set_admission(async_admission test, bool reject = true); //checks periodic functions when they are added. If reject is false, they are added anyway and flagged as ASYNC_OVERLOADED
+    const bool schedulable() const; //whether the periodic functions passed the admission test the last time one was added
+    bool throttle(function<F, Traits> fw); //adds fw, unless a function with the same id is already waiting to run. Returns whether it was added
+    template <tick_t TicksPerUnit>
+    void debounce(function<F, Traits> fw, const duration<TicksPerUnit>& quiet); //runs fw once no function with its id was debounced for quiet
+    template <class ... Args>
+    int emplace(Args&& ... args); //constructs a function from args straight into the task list, due immediately. Returns its index, or -1 if full
+
+    void remove(int index); //removes based on index, in constant time. Other functions keep their index until enough have been removed to compact the list
+
+    function<F, Traits>& get(int index); //gets a function from the index, in [0, slots()). The reference is valid until functions are added or removed
+    const function<F, Traits>* getAll() const; //gets all of the functions, slots() of them; check alive() to skip the removed ones
+
+    int size(); //how many functions are still in the loop
+    int slots(); //how many entries get() and getAll() cover: size(), plus removed functions that are not compacted yet
+    bool alive(int index); //whether the entry at index is a function that is still in the loop
+    int max_size();
+    bool full(); //true while add() would return ASYNC_FULL
+    void sort(); //sorts the tasks list by selection sort based on delay time within the function.
+private:
+    int m_size              = 1; //at least the size of 1
+    int m_permsize          = 1; //size of permanent array
+    int curr_size           = 0; //the current size of the tasks
+    int m_dead              = 0; //functions that have finished, but are still in tasks until the outermost batch ends
+    int m_depth             = 0; //how many event loops are running; more than one when a function waits for a group
+    unsigned long m_generation = 0; //counts batches, so that a batch can tell that a nested one ran underneath it
+    int m_current           = -1; //the index of the function running right now, for park()
+    bool m_driven           = false; //run_once() is driving the loop, so m_last carries over from one call to the next
+    tick_t m_next           = 0; //the delay of the next function that is waiting, cached for should_yield()
+    bool m_next_valid       = false;
+    timestamp m_last;                //the time every delay in tasks is relative to
+    tick_t m_lateness       = 0;
+    tick_t m_max_lateness   = 0;
+    unsigned long m_misses  = 0;
+    unsigned long m_wakeups = 0;
+    bool m_edf              = false;
+    bool m_coalesce         = false;
+    async_admission m_admission = ADMIT_ANY;
+    bool m_reject           = true;
+    bool m_schedulable      = true;
+    function<F, Traits> *tasks        = new function<F, Traits>[m_size]; //creates an array of functions with the size of 1
+    tick_t *m_delays          = new tick_t[m_size]; //the delay of each function in tasks, in ticks
+    int m_due[ASYNC_BATCH_SIZE];          //the indices of the functions in the running batch
+    tick_t m_overdue[ASYNC_BATCH_SIZE];   //how overdue each function of the running batch was when released
+    park_slot* m_slots        = nullptr; //the slots that functions are parked in, linked through park_slot::next
+    function<F, Traits>* m_retired = nullptr; //task lists replaced during a batch, linked through the first function of each
+    task_group<F, Traits>* m_stalled_groups = nullptr; //groups whose continuation found the Async full, linked through next_stalled
+    dag_node<F, Traits>* m_stalled_nodes = nullptr; //nodes released while the Async was full, linked through next_stalled
+    void allocate(int newSize);
+    void deallocate(int newSize);
+    void free_retired(); //frees the task lists that allocate() replaced while functions ran from them
+    bool run_batch(bool block = true); //sleeps until the next function is due (unless block is false) and runs everything due. Returns false if nothing ran or can run
+    tick_t since_last(); //what a delay counted from now needs added, as delays count from m_last while a loop runs or run_once() drives it
+    tick_t counted_from(timestamp start, tick_t delay); //a delay that counts from start, made relative to m_last
+    tick_t until_next(); //ticks until the next function is due (0 if one already is), or ~0 if none is waiting for time
+    void finish(int index); //marks a function as finished, so that it stops running and is removed by compact()
+    void compact(); //removes every finished function in a single pass
+    park_slot* slot_of(int index); //the slot the function at index is parked in. It must have one (see SLOT)
+    void unlink_slot(park_slot* slot); //takes slot out of m_slots, empty
+    void leave_group(task_group<F, Traits>* group); //counts a finished function out of group, and adds the continuation once it is empty
+    void retry_stalled(); //adds what could not be added for lack of room, now that functions may have finished
+    void release_successors(dag_node<F, Traits>* node); //counts down the successors of a finished node, and adds those that are ready
+    void release_node(dag_node<F, Traits>* node); //adds a node that is ready, through its release hook if it has one
+    bool runs_before(int first, int second); //the order of due functions within a batch
+    tick_t latest_wake(); //the end of the earliest slack window, relative to m_last
+    bool admit(const task_timing* candidate); //runs the admission test on the periodic functions plus candidate
+    const task_timing* periodic(int index, const task_timing* candidate); //the timing of a live periodic function; index curr_size is candidate
+    tick_t rate_limit(function<F, Traits>& fw, timestamp release); //how much longer fw must wait for a token, which is then spent
+    int find_waiting(unsigned long id); //the index of a function with id that is waiting to run, or -1
+
+    unsigned long invoke(int index, bool& suspended); //runs a function, on its fiber if it has one. suspended is set if it is still waiting inside the fiber
+#ifdef ASYNC_HAS_FIBERS
+    static void fiber_main(fiber* f);
+    void release_fiber(int index); //hands the fiber of the function at index back to the pool, done or not, with its callable back in tasks
+#endif
+
+    static const unsigned char FINISHED = function<F, Traits>::FINISHED;
+    static const unsigned char RUNNING = function<F, Traits>::RUNNING;
+    static const unsigned char FIBER = function<F, Traits>::FIBER;
+    static const unsigned char PARKED = function<F, Traits>::PARKED;
+    static const unsigned char SLOT = function<F, Traits>::SLOT;
+    static const unsigned char LINK_MASK = function<F, Traits>::LINK_MASK;
+    static const unsigned long PARK = ~0UL; //what park() returns, and what running functions return to be parked
+
+#ifdef ASYNC_HAS_SHARDS
+    template <typename, int, unsigned> friend struct ShardedAsync;
+#endif
+};
+
+/**Implementation for function**/
+template <typename F, typename Traits>
+function<F, Traits>::function() : delay_ticks(0), step(1), id(0) {
+
+}
+
+template <typename F, typename Traits>
+function<F, Traits>::function(F func) : m_func(_move(func)), delay_ticks(0), step(1), id(0) {
+
+}
+
+template <typename F, typename Traits>
+function<F, Traits>::~function() {
+    m_func = nullptr; //makes m_func a null pointer. The function itself must continue to exist.
+    clearLinks();
+}
+
+template <typename F, typename Traits>
+function<F, Traits>::function(const function<F, Traits>& other) : delay_ticks(0), step(1), id(0) {
+    this->m_func = other.m_func;
+    this->delay_ticks = other.delay_ticks;
+    this->step = other.step;
+    this->id = other.id;
+    this->m_link = other.m_link;
+    this->flags = other.flags & ~SLOT; //a copy is never parked, and never shares the fiber of the original, which is left as nullptr
+    if ((flags & LINK_MASK) == (LINK_EXTRAS << LINK_SHIFT)) {
+#ifdef ASYNC_HAS_SHARDS
+        __atomic_add_fetch(&((extras*)m_link)->references, 1, __ATOMIC_RELAXED); //copies may end up on different shards
+#else
+        ((extras*)m_link)->references++;
+#endif
+    }
+}
+
+template <typename F, typename Traits>
+function<F, Traits>::function(function<F, Traits>&& other) : delay_ticks(0), step(1), id(0) {
+    swap(other);
+}
+
+template <typename F, typename Traits>
+template <class ... Args>
+void function<F, Traits>::emplace(Args&& ... args) {
+    m_func = F(_forward<Args>(args)...);
+    delay_ticks = 0;
+    step = 1;
+    id = 0;
+    clearLinks();
+    flags &= FIBER; //keeps running on a fiber if it did
+}
+
+template <typename F, typename Traits>
+const unsigned long function<F, Traits>::get_delay(bool microseconds) const {
+    if (microseconds)
+        return duration_cast< ::microseconds>(ticks(delay_ticks)).count();
+
+    return duration_cast<milliseconds>(ticks(delay_ticks)).count();
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::set_delay(unsigned long delay, bool microseconds) {
+    if (microseconds) {
+        set_delay(::microseconds(delay));
+        return;
+    }
+
+    set_delay(milliseconds(delay));
+}
+
+template <typename F, typename Traits>
+template <typename Unit>
+const Unit function<F, Traits>::get_delay() const {
+    return duration_cast<Unit>(ticks(delay_ticks));
+}
+
+template <typename F, typename Traits>
+template <tick_t TicksPerUnit>
+void function<F, Traits>::set_delay(const duration<TicksPerUnit>& delay) {
+    set_ticks(delay.ticks());
+}
+
+template <typename F, typename Traits>
+const tick_t function<F, Traits>::get_ticks() const {
+    return delay_ticks;
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::set_ticks(tick_t delay) {
+    if (delay > MAX_TICKS)
+        delay = MAX_TICKS; //saturates when the traits narrow the delay
+    delay_ticks = delay;
+}
+
+template <typename F, typename Traits>
+const unsigned long function<F, Traits>::getStep() const {
+    return step;
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::setStep(unsigned long newSize) {
+    step = newSize;
+}
+
+template <typename F, typename Traits>
+const unsigned long function<F, Traits>::getId() const {
+    return id;
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::setId(unsigned long newId) {
+    id = newId;
+}
+
+template <typename F, typename Traits>
+task_group<F, Traits>* function<F, Traits>::getGroup() const {
+    return (task_group<F, Traits>*)getLink(LINK_GROUP);
+}
+
+template <typename F, typename Traits>
+bool function<F, Traits>::setGroup(task_group<F, Traits>* newGroup) {
+    return setLink(LINK_GROUP, newGroup);
+}
+
+template <typename F, typename Traits>
+task_timing* function<F, Traits>::getTiming() const {
+    return (task_timing*)getLink(LINK_TIMING);
+}
+
+template <typename F, typename Traits>
+bool function<F, Traits>::setTiming(task_timing* newTiming) {
+    return setLink(LINK_TIMING, newTiming);
+}
+
+template <typename F, typename Traits>
+const bool function<F, Traits>::getFiber() const {
+    return flags & FIBER;
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::setFiber(bool useFiber) {
+    if (useFiber) flags |= FIBER;
+    else flags &= ~FIBER;
+}
+
+template <typename F, typename Traits>
+token_bucket* function<F, Traits>::getRateLimit() const {
+    return (token_bucket*)getLink(LINK_BUCKET);
+}
+
+template <typename F, typename Traits>
+bool function<F, Traits>::setRateLimit(token_bucket* newBucket) {
+    return setLink(LINK_BUCKET, newBucket);
+}
+
+template <typename F, typename Traits>
+dag_node<F, Traits>* function<F, Traits>::getNode() const {
+    return (dag_node<F, Traits>*)getLink(LINK_NODE);
+}
+
+template <typename F, typename Traits>
+bool function<F, Traits>::setNode(dag_node<F, Traits>* newNode) {
+    return setLink(LINK_NODE, newNode);
+}
+
+template <typename F, typename Traits>
+void* function<F, Traits>::getLink(unsigned char kind) const {
+    unsigned char current = (flags & LINK_MASK) >> LINK_SHIFT;
+    if (current == kind)
+        return m_link;
+    if (current == LINK_EXTRAS)
+        return ((extras*)m_link)->links[kind - 1];
+    return nullptr;
+}
+
+template <typename F, typename Traits>
+bool function<F, Traits>::setLink(unsigned char kind, void* value) {
+    unsigned char current = (flags & LINK_MASK) >> LINK_SHIFT;
+    if (current == 0 || current == kind) { //a single link, kept in m_link itself
+        m_link = value;
+        flags = (flags & ~LINK_MASK) | (value ? kind << LINK_SHIFT : 0);
+        return true;
+    }
+
+    extras* record = current == LINK_EXTRAS ? (extras*)m_link : nullptr;
+    if (record ? record->links[kind - 1] == value : !value)
+        return true; //nothing changes
+
+    if (!record || record->references > 1) {
+        extras* own = record ? new extras(*record) : new extras();
+        if (!own)
+            return false; //out of memory; new returns nullptr on an AVR. The function keeps the links it had
+        own->references = 1;
+        if (!record)
+            own->links[current - 1] = m_link;
+        clearLinks(); //lets go of the shared record
+        m_link = record = own;
+        flags |= LINK_EXTRAS << LINK_SHIFT;
+    }
+    record->links[kind - 1] = value;
+    return true;
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::clearLinks() {
+    if ((flags & LINK_MASK) == (LINK_EXTRAS << LINK_SHIFT)) {
+        extras* record = (extras*)m_link;
+#ifdef ASYNC_HAS_SHARDS
+        if (__atomic_sub_fetch(&record->references, 1, __ATOMIC_ACQ_REL) == 0)
+#else
+        if (--record->references == 0)
+#endif
+            delete record;
+    }
+    m_link = nullptr;
+    flags &= ~LINK_MASK;
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::operator=(const function<F, Traits>& other) {
+    this->m_func = other.m_func;
+    this->delay_ticks = other.delay_ticks;
+    this->step = other.step;
+    this->id = other.id;
+    if (this != &other) {
+        clearLinks();
+        this->m_link = other.m_link;
+        this->flags = other.flags & ~SLOT; //a copy is never parked
+        if ((flags & LINK_MASK) == (LINK_EXTRAS << LINK_SHIFT)) {
+#ifdef ASYNC_HAS_SHARDS
+            __atomic_add_fetch(&((extras*)m_link)->references, 1, __ATOMIC_RELAXED);
+#else
+            ((extras*)m_link)->references++;
+#endif
+        }
+    }
+#ifdef ASYNC_HAS_FIBERS
+    this->running_fiber = nullptr; //a copy never shares the fiber of the original
+#endif
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::operator=(function<F, Traits>&& other) {
+    swap(other);
+}
+
+template <typename F, typename Traits>
+const bool function<F, Traits>::operator==(const function<F, Traits>& other) const {
+    return (this->m_func == other.m_func && this->delay_ticks == other.delay_ticks && this->step == other.step && this->id == other.id);
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::swap(function<F, Traits>& other) {
+    _swap(this->m_func, other.m_func);
+    swapState(other);
+}
+
+template <typename F, typename Traits>
+void function<F, Traits>::swapState(function<F, Traits>& other) {
+    //Bitfields cannot be bound to references, so they are swapped by hand
+    tick_t delay = this->delay_ticks;
+    this->delay_ticks = other.delay_ticks;
+    other.delay_ticks = delay;
+    unsigned long otherStep = other.step;
+    other.step = this->step;
+    this->step = otherStep;
+    unsigned long otherId = other.id;
+    other.id = this->id;
+    this->id = otherId;
+    _swap(this->m_link, other.m_link);
+#ifdef ASYNC_HAS_FIBERS
+    _swap(this->running_fiber, other.running_fiber);
+#endif
+    _swap(this->flags, other.flags);
+}
+
+template <typename F, typename Traits>
+template <typename R, class ... Tn>
+R function<F, Traits>::run(Tn ... args) {
+    return m_func(args...); //calls the function with the parameters
+}
+
+/**Implementation for task_group**/
+template <typename F, typename Traits>
+void task_group<F, Traits>::then(function<F, Traits>&& continuation) {
+    this->continuation = _move(continuation);
+    has_continuation = true;
+}
+
+template <typename F, typename Traits>
+void task_group<F, Traits>::then(const function<F, Traits>& continuation) {
+    then(function<F, Traits>(continuation));
+}
+
+template <typename F, typename Traits>
+const int task_group<F, Traits>::size() const {
+    return pending;
+}
+
+/**Implementation for dag_node**/
+template <typename F, typename Traits>
+dag_node<F, Traits>::dag_node(function<F, Traits> fw) : task(_move(fw)) {
+    task.setNode(this); //the function releases the successors of this node when it finishes
+}
+
+template <typename F, typename Traits>
+bool dag_node<F, Traits>::after(dag_node& predecessor) {
+    if (predecessor.m_successors >= ASYNC_DAG_SUCCESSORS)
+        return false;
+
+    predecessor.successors[predecessor.m_successors++] = this;
+    m_pending++;
+    return true;
+}
+
+template <typename F, typename Traits>
+void dag_node<F, Traits>::set_release(bool (*release)(function<F, Traits>&& fw, void* context), void* context) {
+    this->release = release;
+    this->context = context;
+}
+
+template <typename F, typename Traits>
+const int dag_node<F, Traits>::pending() const {
+#ifdef ASYNC_HAS_SHARDS
+    return __atomic_load_n(&m_pending, __ATOMIC_ACQUIRE);
+#else
+    return m_pending;
+#endif
+}
+
+/**Implementation for Async**/
+template <typename F, typename Clock, typename Traits>
+Async<F, Clock, Traits>::Async() {
+
+}
+
+template <typename F, typename Clock, typename Traits>
+Async<F, Clock, Traits>::~Async() {
+    while (m_slots)
+        unlink_slot(m_slots); //the slots outlive the Async, and must not look waiting
+#ifdef ASYNC_HAS_FIBERS
+    for (int iii = 0; iii < curr_size; iii++)
+        if (tasks[iii].running_fiber)
+            release_fiber(iii); //abandons the functions still waiting in a fiber
+#endif
+    free_retired();
+    delete[] tasks;
+    delete[] m_delays;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::run_until_complete() {
+    /* Starts the loop to complete the task list */
+    if (m_depth++ == 0 && !m_driven) m_last = Clock::now();
+    while (curr_size > m_dead && run_batch());
+    m_depth--;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::run_until_complete(task_group<F, Traits>& group) {
+    if (m_depth++ == 0 && !m_driven) m_last = Clock::now();
+    while (group.pending > 0 && run_batch());
+    m_depth--;
+}
+
+template <typename F, typename Clock, typename Traits>
+unsigned long Async<F, Clock, Traits>::run_once() {
+    if (m_depth == 0 && !m_driven) {
+        m_last = Clock::now(); //delays count from the first call, just like from the start of run_until_complete()
+        m_driven = true;
+    }
+
+    m_depth++;
+    run_batch(false);
+    m_depth--;
+
+    tick_t next = until_next();
+    if (m_depth == 0 && size() == 0)
+        m_driven = false; //whatever is added next counts from the next call
+    if (next == ~(tick_t)0)
+        return ~0UL;
+
+    return duration_cast<microseconds>(ticks(next + ASYNC_TICKS_PER_US - 1)).count(); //rounds up, so that sleeping that long never wakes too early
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::run_until(timestamp deadline) {
+    while (true) {
+        run_once();
+        tick_t next = until_next();
+        timestamp now = Clock::now();
+        if (next == ~(tick_t)0 || now >= deadline)
+            return;
+
+        tick_t left = deadline - now;
+        if (next > 0) {
+            m_wakeups++;
+            Clock::sleep(next < left ? next : left);
+        }
+    }
+}
+
+template <typename F, typename Clock, typename Traits>
+template <tick_t TicksPerUnit>
+void Async<F, Clock, Traits>::run_for(const duration<TicksPerUnit>& time) {
+    run_until(timestamp(Clock::now()) + time.ticks());
+}
+
+template <typename F, typename Clock, typename Traits>
+tick_t Async<F, Clock, Traits>::since_last() {
+    if (m_depth == 0 && !m_driven)
+        return 0; //m_last is reset when the next loop starts
+
+    return timestamp(Clock::now()) - m_last;
+}
+
+template <typename F, typename Clock, typename Traits>
+tick_t Async<F, Clock, Traits>::counted_from(timestamp start, tick_t delay) {
+    if (start < m_last) { //a nested loop woke up after start
+        tick_t gone = m_last - start;
+        return delay > gone ? delay - gone : 0;
+    }
+
+    tick_t ahead = start - m_last;
+    return delay < ~(tick_t)0 - ahead ? delay + ahead : ~(tick_t)0 - 1; //saturates below ~0, which marks functions not waiting for time
+}
+
+template <typename F, typename Clock, typename Traits>
+tick_t Async<F, Clock, Traits>::until_next() {
+    if (curr_size == m_dead)
+        return ~(tick_t)0;
+
+    int next = _min_index(m_delays, 0, curr_size);
+    if (tasks[next].flags & (FINISHED | RUNNING | PARKED))
+        return ~(tick_t)0;
+
+    tick_t wake = m_coalesce ? latest_wake() : m_delays[next];
+    tick_t elapsed = timestamp(Clock::now()) - m_last;
+    return wake > elapsed ? wake - elapsed : 0;
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::run_batch(bool block) {
+    if (curr_size == m_dead)
+        return false;
+
+    //Sleeps until the next function is due. The clock is read again afterwards, so oversleeping is never lost.
+    int next = _min_index(m_delays, 0, curr_size);
+    if (tasks[next].flags & (FINISHED | RUNNING | PARKED))
+        return false; //everything left is parked, or already running further up the stack, so a nested loop would wait forever
+
+    tick_t wake = m_coalesce ? latest_wake() : m_delays[next];
+    tick_t elapsed = timestamp(Clock::now()) - m_last; //wrap around safe
+    if (wake > elapsed) {
+        if (!block)
+            return false; //nothing is due yet
+        m_wakeups++;
+        int outer = m_current;
+        m_current = -1; //functions that arrive while sleeping (see ShardClock) count from when they arrive, even in a nested loop
+        Clock::sleep(wake - elapsed);
+        m_current = outer;
+    }
+
+    timestamp now = Clock::now();
+    elapsed = now - m_last;
+    if (elapsed < m_delays[next])
+        return true; //woke up early, go back to sleep
+
+    //Gathers the functions that are due, most overdue first, eight delays at a time. Only the first ASYNC_BATCH_SIZE of them
+    //run in this batch; the rest are due at this wake up once the delays are offset, so the next batch runs them right away.
+    int count = 0;
+    int found[8];
+    for (int base = 0; base < curr_size; base += 8) {
+        int chunk = _find_due(m_delays + base, curr_size - base < 8 ? curr_size - base : 8, elapsed, found);
+        for (int kkk = 0; kkk < chunk; kkk++) {
+            int index = base + found[kkk];
+            int jjj = count;
+            if (count == ASYNC_BATCH_SIZE) {
+                if (!runs_before(index, m_due[count - 1]))
+                    continue;
+                jjj--; //takes the place of the last one
+            }
+            else count++;
+
+            for (; jjj > 0 && runs_before(index, m_due[jjj - 1]); jjj--) //insertion sort; batches are small
+                m_due[jjj] = m_due[jjj - 1];
+            m_due[jjj] = index;
+        }
+    }
+    for (int iii = 0; iii < count; iii++)
+        m_overdue[iii] = elapsed - m_delays[m_due[iii]];
+    m_lateness = elapsed - m_delays[next]; //the most overdue function, even if it waits for the next batch
+    if (m_lateness > m_max_lateness) m_max_lateness = m_lateness;
+
+    //Charges the time that really elapsed to every function, once per wake up
+    offsetDelayBy(elapsed);
+    m_last = now;
+
+    //Runs the whole batch. Delays returned by the batch count from when each function started, like they always have.
+    //Running functions are parked at the largest delay, so that a nested loop (see task_group) never runs them twice.
+    unsigned long generation = ++m_generation;
+    for (int iii = 0; iii < count; iii++) {
+        int index = m_due[iii];
+        if (tasks[index].flags & (FINISHED | PARKED))
+            continue; //removed by a function earlier in this batch, or waiting for wake()
+
+        tasks[index].flags |= RUNNING;
+        m_delays[index] = ~(tick_t)0;
+        m_next_valid = false;
+
+        bool suspended;
+        timestamp started = Clock::now(); //the functions before this one took time, which the delay it returns must not lose
+        timestamp woken = m_last; //with overdue, when the function was released. A nested batch overwrites both
+        tick_t overdue = m_overdue[iii];
+        int outer = m_current; //set when this batch runs nested inside another function
+        m_current = index;
+        unsigned long returnValue = invoke(index, suspended);
+        m_current = outer;
+        tasks[index].flags &= ~RUNNING;
+        bool removed = tasks[index].flags & FINISHED; //removed while it ran, by itself or by a nested loop
+
+        //Checks the deadline; the response time counts from the release of the function, not from this wake up
+        task_timing* timing = tasks[index].getTiming();
+        if (!suspended && !removed && timing && timing->deadline > 0) {
+            tick_t response = (timestamp(Clock::now()) - woken) + overdue;
+            if (response > timing->deadline) {
+                m_misses++;
+                if (timing->on_miss) timing->on_miss(tasks[index].getId(), response - timing->deadline);
+            }
+        }
+
+        if (removed) {
+#ifdef ASYNC_HAS_FIBERS
+            if (tasks[index].running_fiber)
+                release_fiber(index); //abandons whatever the function was waiting for
+#endif
+        }
+        else if (!suspended && returnValue == PARK) {
+            if (tasks[index].flags & SLOT)
+                tasks[index].flags |= PARKED; //keeps the largest delay until wake()
+            else m_delays[index] = 0; //woken up before it even returned
+        }
+        else if (suspended)
+            m_delays[index] = counted_from(started, microseconds(returnValue).ticks()); //resumes the fiber once its wait() is over, without counting a step
+        else if (returnValue > 0) {
+            m_delays[index] = counted_from(started, microseconds(returnValue).ticks()); //functions return microseconds; converting to ticks is a constant multiplication
+            if (tasks[index].getRateLimit())
+                m_delays[index] += rate_limit(tasks[index], m_last + m_delays[index]);
+            tasks[index].setStep(tasks[index].getStep() + 1); //increases the steps by 1
+        }
+        else finish(index); //removes the function if the return value is 0
+
+        if (generation != m_generation)
+            break; //a nested loop ran, so the rest of this batch is stale. Whatever is still due runs on the next wake up
+    }
+
+    //Removes the finished functions in one step, once they are a quarter of the list. Nested loops leave this to the outermost one, so indices stay valid.
+    if (m_depth == 1 && m_dead > curr_size / 4)
+        compact();
+    if (m_depth == 1)
+        free_retired(); //no function runs from the old lists anymore
+    if (m_stalled_groups || m_stalled_nodes)
+        retry_stalled();
+    return true;
+}
+
+template <typename F, typename Clock, typename Traits>
+unsigned long Async<F, Clock, Traits>::invoke(int index, bool& suspended) {
+    suspended = false;
+#ifdef ASYNC_HAS_FIBERS
+    if (tasks[index].flags & FIBER) {
+        fiber* f = tasks[index].running_fiber;
+        if (!f)
+            f = tasks[index].running_fiber = _fiber_acquire(&fiber_main);
+
+        if (f) { //otherwise the pool is empty, and the function simply blocks
+            fiber* outer = _fiber_current(); //set when a nested loop runs inside another fiber
+            f->task = &tasks[index]; //the function may have moved since the fiber last ran
+            _fiber_current() = f;
+            _fiber_resume(f);
+            _fiber_current() = outer;
+
+            if (!f->done) {
+                suspended = true;
+                return f->wait;
+            }
+
+            release_fiber(index);
+            return f->result;
+        }
+    }
+#endif
+    //The callable runs in place. If it adds functions and the task list grows, allocate() leaves it in the old list until it returns
+    function<F, Traits>* home = &tasks[index];
+    unsigned long result = home->m_func(home->getStep(), home->getId());
+    if (home != &tasks[index])
+        tasks[index].m_func = _move(home->m_func); //catches up with the rest of the function
+    return result;
+}
+
+#ifdef ASYNC_HAS_FIBERS
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::fiber_main(fiber* f) {
+    //The callable is moved onto the fiber stack, so it stays put while the task list grows or is compacted around it
+    function<F, Traits>* home = (function<F, Traits>*)f->task;
+    F func = _move(home->m_func);
+    f->callable = &func; //home may be stale by the time the fiber is done or abandoned; release_fiber() moves func back through tasks
+    unsigned long result = func(home->getStep(), home->getId());
+
+    f->result = result;
+    f->done = true;
+    _fiber_current() = nullptr;
+    _fiber_suspend(f); //never resumed; the fiber goes back to the pool
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::release_fiber(int index) {
+    //The callable goes back through tasks, as the function may have moved since its last wait()
+    fiber* f = tasks[index].running_fiber;
+    F* func = (F*)f->callable;
+    tasks[index].m_func = _move(*func);
+    func->~F(); //the fiber stack is reused without unwinding, so its locals are never destroyed otherwise
+    tasks[index].running_fiber = nullptr;
+    _fiber_release(f);
+}
+#endif
+
+template <typename F, typename Clock, typename Traits>
+tick_t Async<F, Clock, Traits>::latest_wake() {
+    //Only read when coalescing, as it touches the cold task list
+    tick_t latest = ~(tick_t)0;
+    for (int iii = 0; iii < curr_size; iii++) {
+        if (tasks[iii].flags & (FINISHED | RUNNING | PARKED))
+            continue;
+
+        tick_t end = m_delays[iii];
+        task_timing* timing = tasks[iii].getTiming();
+        if (timing)
+            end = end + timing->slack < end ? ~(tick_t)0 : end + timing->slack; //saturates
+        if (end < latest)
+            latest = end;
+    }
+    return latest;
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::runs_before(int first, int second) {
+    if (!m_edf)
+        return m_delays[first] < m_delays[second]; //most overdue first
+
+    //Earliest absolute deadline first. Functions without a deadline run after all of those with one, most overdue first.
+    task_timing* firstTiming = tasks[first].getTiming();
+    task_timing* secondTiming = tasks[second].getTiming();
+    bool firstHas = firstTiming && firstTiming->deadline > 0;
+    bool secondHas = secondTiming && secondTiming->deadline > 0;
+    if (firstHas != secondHas)
+        return firstHas;
+    if (!firstHas)
+        return m_delays[first] < m_delays[second];
+
+    return (uint64_t)m_delays[first] + firstTiming->deadline < (uint64_t)m_delays[second] + secondTiming->deadline;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::finish(int index) {
+    tasks[index].flags |= FINISHED;
+    m_delays[index] = ~(tick_t)0;
+    m_dead++;
+
+    if (tasks[index].flags & SLOT) {
+        unlink_slot(slot_of(index));
+        tasks[index].flags &= ~SLOT;
+    }
+
+    //index is not used past this point: the group continuation and the successors are added below, and add() may compact
+    task_group<F, Traits>* group = tasks[index].getGroup();
+    dag_node<F, Traits>* node = tasks[index].getNode();
+    tasks[index].clearLinks(); //a finished function never runs again, so it needs none of them
+
+    leave_group(group);
+    if (node)
+        release_successors(node);
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::compact() {
+    int size = 0;
+    for (int iii = 0; iii < curr_size; iii++) {
+        if (tasks[iii].flags & FINISHED)
+            continue;
+
+        if (iii != size) {
+            tasks[size] = _move(tasks[iii]);
+            m_delays[size] = m_delays[iii];
+            if (tasks[size].flags & SLOT)
+                slot_of(iii)->index = size; //the slot follows its function. Slots already moved point below iii, so they never match
+        }
+        size++;
+    }
+
+    for (int iii = size; iii < curr_size; iii++)
+        tasks[iii] = function<F, Traits>(); //releases whatever the finished functions held
+
+    curr_size = size;
+    m_dead = 0;
+    if (curr_size < (m_size / 2)) deallocate(m_size / 2); //deallocates memory if not needed
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::should_yield() {
+    if (!m_next_valid) {
+        m_next = ~(tick_t)0;
+        if (curr_size > 0) {
+            int next = _min_index(m_delays, 0, curr_size);
+            if (!(tasks[next].flags & (FINISHED | RUNNING | PARKED)))
+                m_next = m_delays[next];
+        }
+        m_next_valid = true;
+    }
+
+    return m_next != ~(tick_t)0 && timestamp(Clock::now()) - m_last >= m_next;
+}
+
+template <typename F, typename Clock, typename Traits>
+unsigned long Async<F, Clock, Traits>::park(park_slot& slot) {
+    if (m_current < 0 || slot.waiting())
+        return yield_point(); //not inside a function, or the slot is taken; tries again right after what is due
+
+    if (tasks[m_current].flags & SLOT)
+        unlink_slot(slot_of(m_current)); //a function waits in one slot at a time
+    slot.index = m_current;
+    slot.next = m_slots;
+    m_slots = &slot;
+    tasks[m_current].flags |= SLOT;
+    return PARK;
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::wake(park_slot& slot) {
+    if (!slot.waiting())
+        return false;
+
+    int index = slot.index;
+    unlink_slot(&slot);
+    tasks[index].flags &= ~SLOT;
+    if (tasks[index].flags & PARKED) { //otherwise it is still running, and runs again as soon as it returns
+        tasks[index].flags &= ~PARKED;
+        m_delays[index] = 0;
+        m_next_valid = false;
+    }
+    return true;
+}
+
+template <typename F, typename Clock, typename Traits>
+park_slot* Async<F, Clock, Traits>::slot_of(int index) {
+    park_slot* slot = m_slots;
+    while (slot->index != index)
+        slot = slot->next;
+    return slot;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::unlink_slot(park_slot* slot) {
+    park_slot** link = &m_slots;
+    while (*link != slot)
+        link = &(*link)->next;
+    *link = slot->next;
+    slot->next = nullptr;
+    slot->index = -1;
+}
+
+template <typename F, typename Clock, typename Traits>
+unsigned long Async<F, Clock, Traits>::yield_point() {
+    //Everything that is due has a delay of at most the time since the last wake up, so one microsecond more comes after all of it
+    return duration_cast<microseconds>(ticks(timestamp(Clock::now()) - m_last)).count() + 1;
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::throttle(function<F, Traits> fw) {
+    if (find_waiting(fw.getId()) >= 0)
+        return false; //coalesced into the function that is already waiting
+
+    add(_move(fw));
+    return true;
+}
+
+template <typename F, typename Clock, typename Traits>
+template <tick_t TicksPerUnit>
+void Async<F, Clock, Traits>::debounce(function<F, Traits> fw, const duration<TicksPerUnit>& quiet) {
+    int index = find_waiting(fw.getId());
+    if (index >= 0) {
+        m_delays[index] = quiet.ticks() + since_last(); //pushes the waiting function back instead of queueing another one
+        m_next_valid = false;
+        return;
+    }
+
+    fw.set_ticks(quiet.ticks() + (m_current >= 0 ? since_last() : 0)); //add() takes care of the offset unless a function is running
+    add(_move(fw));
+}
+
+template <typename F, typename Clock, typename Traits>
+int Async<F, Clock, Traits>::find_waiting(unsigned long id) {
+    for (int iii = 0; iii < curr_size; iii++) {
+        if (tasks[iii].getId() == id && !(tasks[iii].flags & (FINISHED | RUNNING | PARKED)))
+            return iii;
+    }
+    return -1;
+}
+
+template <typename F, typename Clock, typename Traits>
+tick_t Async<F, Clock, Traits>::rate_limit(function<F, Traits>& fw, timestamp release) {
+    token_bucket* bucket = fw.getRateLimit();
+    tick_t wait = bucket->delay_for(release);
+    bucket->take(release + wait);
+    return wait;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::leave_group(task_group<F, Traits>* group) {
+    if (!group)
+        return;
+
+    if (--group->pending > 0 || !group->has_continuation)
+        return;
+
+    if (add(_move(group->continuation)) == ASYNC_FULL) { //add() leaves the continuation alone when it has no room
+        group->pending = 1; //the continuation still counts, so that waiting for the group waits for it too
+        group->next_stalled = m_stalled_groups;
+        m_stalled_groups = group;
+        return;
+    }
+    group->has_continuation = false; //woken up
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::retry_stalled() {
+    task_group<F, Traits>* groups = m_stalled_groups;
+    m_stalled_groups = nullptr;
+    while (groups) {
+        task_group<F, Traits>* group = groups;
+        groups = group->next_stalled;
+        leave_group(group); //stalls again if there is still no room
+    }
+
+    dag_node<F, Traits>* nodes = m_stalled_nodes;
+    m_stalled_nodes = nullptr;
+    while (nodes) {
+        dag_node<F, Traits>* node = nodes;
+        nodes = node->next_stalled;
+        release_node(node);
+    }
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::release_successors(dag_node<F, Traits>* node) {
+    for (int iii = 0; iii < node->m_successors; iii++) {
+        dag_node<F, Traits>* next = node->successors[iii];
+#ifdef ASYNC_HAS_SHARDS
+        if (__atomic_sub_fetch(&next->m_pending, 1, __ATOMIC_ACQ_REL) > 0)
+            continue; //predecessors may finish on different shards at once
+#else
+        if (--next->m_pending > 0)
+            continue;
+#endif
+
+        release_node(next);
+    }
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::release_node(dag_node<F, Traits>* node) {
+    if (node->release && node->release(_move(node->task), node->context))
+        return;
+    if (add(_move(node->task)) == ASYNC_FULL) { //runs here, if there is no release hook or it had no room
+        node->next_stalled = m_stalled_nodes; //add() leaves the task alone when it has no room
+        m_stalled_nodes = node;
+    }
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::set_edf(bool edf) {
+    m_edf = edf;
+}
+
+template <typename F, typename Clock, typename Traits>
+const unsigned long Async<F, Clock, Traits>::misses() const {
+    return m_misses;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::set_coalescing(bool coalesce) {
+    m_coalesce = coalesce;
+}
+
+template <typename F, typename Clock, typename Traits>
+const unsigned long Async<F, Clock, Traits>::wakeups() const {
+    return m_wakeups;
+}
+
+template <typename F, typename Clock, typename Traits>
+const tick_t Async<F, Clock, Traits>::lateness() const {
+    return m_lateness;
+}
+
+template <typename F, typename Clock, typename Traits>
+const tick_t Async<F, Clock, Traits>::max_lateness() const {
+    return m_max_lateness;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::reset_stats() {
+    m_lateness = 0;
+    m_max_lateness = 0;
+    m_misses = 0;
+    m_wakeups = 0;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::offsetDelayBy(tick_t offsetDelay) {
+    _subtract_saturate(m_delays, curr_size, offsetDelay); //sets to zero if the delay would overflow
+}
+
+template <typename F, typename Clock, typename Traits>
+async_status Async<F, Clock, Traits>::add(const function<F, Traits>& fw) {
+    return add(function<F, Traits>(fw));
+}
+
+template <typename F, typename Clock, typename Traits>
+async_status Async<F, Clock, Traits>::add(function<F, Traits>&& fw) {
+    if (full())
+        return ASYNC_FULL; //return. It's game over man, it's game over.
+    if (curr_size >= MAX_FUNCTIONARRAY_SIZE)
+        compact(); //only removed functions take up the room, and no loop is running that could hold their indices. finish() lets go of its index before it adds anything
+
+    async_status status = ASYNC_OK;
+    if (m_admission != ADMIT_ANY && fw.getTiming() && fw.getTiming()->period > 0) {
+        m_schedulable = admit(fw.getTiming());
+        if (!m_schedulable && m_reject)
+            return ASYNC_UNSCHEDULABLE;
+        if (!m_schedulable)
+            status = ASYNC_OVERLOADED;
+    }
+
+    if (curr_size >= m_size)
+        allocate(m_size * 2);
+
+    if (fw.getGroup())
+        fw.getGroup()->pending++;
+
+    fw.flags &= FIBER | LINK_MASK; //clears the state left from any earlier Async
+    m_next_valid = false;
+    m_delays[curr_size] = fw.get_ticks();
+    if (m_current < 0)
+        m_delays[curr_size] += since_last(); //delays count from now, while m_last stays from the last wake up. Only functions add relative to their batch
+    if (fw.getRateLimit())
+        m_delays[curr_size] += rate_limit(fw, timestamp(Clock::now()) + fw.get_ticks());
+    tasks[curr_size++] = _move(fw); //adds the fucntion into the task list
+    return status;
+}
+
+template <typename F, typename Clock, typename Traits>
+async_status Async<F, Clock, Traits>::add(function<F, Traits> fw, task_group<F, Traits>& group) {
+    if (!fw.setGroup(&group))
+        return ASYNC_FULL; //no memory for the side record that holds the group next to another link
+    return add(_move(fw));
+}
+
+template <typename F, typename Clock, typename Traits>
+async_status Async<F, Clock, Traits>::add(dag_node<F, Traits>& node) {
+    if (node.pending() > 0)
+        return ASYNC_OK; //the last predecessor to finish adds it
+
+    return add(_move(node.task));
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::set_admission(async_admission test, bool reject) {
+    m_admission = test;
+    m_reject = reject;
+}
+
+template <typename F, typename Clock, typename Traits>
+const bool Async<F, Clock, Traits>::schedulable() const {
+    return m_schedulable;
+}
+
+template <typename F, typename Clock, typename Traits>
+const task_timing* Async<F, Clock, Traits>::periodic(int index, const task_timing* candidate) {
+    if (index == curr_size)
+        return candidate;
+
+    const task_timing* timing = tasks[index].getTiming();
+    if (!timing || timing->period == 0 || (tasks[index].flags & FINISHED))
+        return nullptr;
+    return timing;
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::admit(const task_timing* candidate) {
+    if (m_admission == ADMIT_EDF) {
+        //Total density in 32.32 fixed point, rounding every term up so that the test never passes by rounding error
+        uint64_t density = 0;
+        for (int iii = 0; iii <= curr_size; iii++) {
+            const task_timing* timing = periodic(iii, candidate);
+            if (!timing) continue;
+
+            density += (((uint64_t)timing->wcet << 32) + timing->relative_deadline() - 1) / timing->relative_deadline();
+            if (density > ((uint64_t)1 << 32))
+                return false;
+        }
+        return true;
+    }
+
+    //Response time analysis: R = C + sum of ceil(R / T) * C over every function with a higher priority, iterated until R
+    //settles (schedulable) or passes the deadline (not schedulable). Shorter deadlines have higher priority; ties go by index.
+    for (int iii = 0; iii <= curr_size; iii++) {
+        const task_timing* timing = periodic(iii, candidate);
+        if (!timing) continue;
+
+        const tick_t deadline = timing->relative_deadline();
+        uint64_t response = timing->wcet;
+        uint64_t previous = 0;
+        while (response != previous) {
+            if (response > deadline)
+                return false;
+
+            previous = response;
+            response = timing->wcet;
+            for (int jjj = 0; jjj <= curr_size; jjj++) {
+                const task_timing* other = periodic(jjj, candidate);
+                if (!other || jjj == iii) continue;
+                if (other->relative_deadline() > deadline || (other->relative_deadline() == deadline && jjj > iii)) continue;
+
+                response += ((previous + other->period - 1) / other->period) * other->wcet;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename F, typename Clock, typename Traits>
+template <class ... Args>
+int Async<F, Clock, Traits>::emplace(Args&& ... args) {
+    if (full())
+        return -1;
+    if (curr_size >= MAX_FUNCTIONARRAY_SIZE)
+        compact();
+
+    if (curr_size >= m_size)
+        allocate(m_size * 2);
+
+    tasks[curr_size].emplace(_forward<Args>(args)...);
+    m_delays[curr_size] = 0;
+    m_next_valid = false; //it is due right away, which should_yield() has to see
+    return curr_size++;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::remove(int index) {
+    /* Invalid Parameter checking */
+    if (index >= curr_size)
+        return; //Arduinos can't throw exceptions;
+
+    if (index < 0)
+        return; //it needs work continuously!
 
-/*
-Function created to switch between microseconds and millseconds delay().
-Note that delayMicroseconds() is accurate only up to 16383us.
-*/
-void wait(const unsigned long time, const bool microseconds = true) {
-    if (microseconds && time > 16383) //Arduino can only accurate delay 16383 microseconds. Anything higher we have to use delay()
-        delay(time / 1000);
-    else if (microseconds)
-        delayMicroseconds(time);
-    else if (!microseconds)
-        delay(time);
+    if (tasks[index].flags & FINISHED)
+        return; //already removed
+
+#ifdef ASYNC_HAS_FIBERS
+    if (tasks[index].running_fiber && !(tasks[index].flags & RUNNING))
+        release_fiber(index); //abandons whatever the function was waiting for
+#endif
+    finish(index); //a tombstone; the function is never run again, and is dropped by the next compaction
+    m_next_valid = false;
+
+    if (m_depth == 0 && m_dead > curr_size / 4)
+        compact(); //inside the loop, the outermost batch does this once it ends
+    if (m_depth == 0 && (m_stalled_groups || m_stalled_nodes))
+        retry_stalled();
 }
 
-/*
-The swap function. It is just more elegant to swap with a single swap() function than writing the temporary variables, and then exchanging their variables over and over
-again.
-*/
-template <typename T>
-void _swap(T& first, T& other) {
-    T tmp = first;
-    first = other;
-    other = tmp;
+template <typename F, typename Clock, typename Traits>
+function<F, Traits>& Async<F, Clock, Traits>::get(int index) {
+    if (index >= curr_size)
+        index = curr_size - 1;
+
+    tasks[index].set_ticks(m_delays[index]);
+    return tasks[index];
+}
+
+template <typename F, typename Clock, typename Traits>
+const function<F, Traits>* Async<F, Clock, Traits>::getAll() const {
+    for (int iii = 0; iii < curr_size; iii++)
+        tasks[iii].set_ticks(m_delays[iii]); //brings the cold copies of the delays up to date
+
+    return tasks;
+}
+
+template <typename F, typename Clock, typename Traits>
+int Async<F, Clock, Traits>::slots() {
+    return curr_size;
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::alive(int index) {
+    return index >= 0 && index < curr_size && !(tasks[index].flags & FINISHED);
+}
+
+template <typename F, typename Clock, typename Traits>
+int Async<F, Clock, Traits>::max_size() {
+    return m_size;
+}
+
+template <typename F, typename Clock, typename Traits>
+int Async<F, Clock, Traits>::size() {
+    return curr_size - m_dead;
+}
+
+template <typename F, typename Clock, typename Traits>
+bool Async<F, Clock, Traits>::full() {
+    //Removed functions only give their room back once they are compacted, which a running loop leaves until its batch ends
+    return size() >= MAX_FUNCTIONARRAY_SIZE || (curr_size >= MAX_FUNCTIONARRAY_SIZE && m_depth > 0);
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::allocate(int newSize) {
+    function<F, Traits> *newTasks = new function<F, Traits>[newSize];
+    tick_t *newDelays = new tick_t[newSize];
+    if (newSize > m_size) {
+        for (unsigned int iii = 0; iii < curr_size; iii++) {
+            if (tasks[iii].flags & RUNNING)
+                newTasks[iii].swapState(tasks[iii]); //the callable stays where it runs; invoke() moves it over once it returns
+            else newTasks[iii] = _move(tasks[iii]);
+            newDelays[iii] = m_delays[iii];
+        }
+    }
+    if (m_depth > 0 && curr_size > 0) {
+        //A function of the batch may be running from this list, so it is freed once the outermost batch ends. The first
+        //function was moved out, and is left without links, so its link chains the retired lists together.
+        tasks[0].m_link = m_retired;
+        m_retired = tasks;
+    }
+    else delete[] tasks; //delete tasks
+    delete[] m_delays;
+    tasks = newTasks;
+    m_delays = newDelays;
+    m_size = newSize;
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::free_retired() {
+    while (m_retired) {
+        function<F, Traits>* list = m_retired;
+        m_retired = (function<F, Traits>*)list[0].m_link;
+        list[0].m_link = nullptr;
+        delete[] list;
+    }
+}
+
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::deallocate(int newSize) {
+    function<F, Traits> *newTasks = new function<F, Traits>[newSize];
+    tick_t *newDelays = new tick_t[newSize];
+    for (unsigned int iii = 0; iii < newSize; iii++) {
+        newTasks[iii] = _move(tasks[iii]);
+        newDelays[iii] = m_delays[iii];
+    }
+    delete[] tasks; //delete tasks
+    delete[] m_delays;
+    tasks = newTasks;
+    m_delays = newDelays;
+    m_size = newSize;
 }
 
+template <typename F, typename Clock, typename Traits>
+void Async<F, Clock, Traits>::sort() {
+    //Don't sort if the size is 0. The index used is unsigned int, so curr_size - 1 will never be achieved.
+    if (curr_size == 0)
+        return;
+
+    //Selection Sort implementation
+    for (int currentIndex = 0; currentIndex < curr_size - 1; currentIndex++) {
+        int smallestIndex = _min_index(m_delays, currentIndex, curr_size); //only the hot delay array is read while searching
+
+        if (currentIndex != smallestIndex) {
+            _swap(m_delays[currentIndex], m_delays[smallestIndex]);
+            tasks[currentIndex].swap(tasks[smallestIndex]); //swaps the two
+        }
+    }
+}
 
 /**
- * Function. This structure can wrap any kind of function, which is used by Async to call functions. Return value is ignored, as we are not using futures/promises (too much work for an Arduino project)
+ * Channel. A bounded queue of up to Size values of T, in static storage, between the functions of one Async. A receiver that
+ * finds it empty parks until the next send, and a sender that finds it full parks until a receive makes room, so an idle
+ * receiver costs no dispatches at all, and a fast sender cannot run ahead of a slow receiver:
+ *      unsigned long consumer(unsigned long step, unsigned long id) {
+ *          int value;
+ *          while (samples.receive(value)) use(value);
+ *          return samples.wait_receive(); //parks until the next send
+ *      }
+ *      unsigned long producer(unsigned long step, unsigned long id) {
+ *          if (!samples.send(read_sensor())) return samples.wait_send(); //parks until there is room
+ *          return 1000;
+ *      }
+ * There is one receiver, and up to Senders parked senders (any number may send); further senders that find it full try again
+ * after everything that is due. To pass values between threads, see spsc_ring and ShardedAsync.
  **/
-template <typename F>
-struct function final {
+template <typename T, unsigned Size, typename AsyncT, int Senders = 4>
+struct channel final {
     public:
-        function()=default;
-        function(F func);
-        ~function();
+        static_assert((Size & (Size - 1)) == 0, "the size of a channel must be a power of 2");
 
-        function(const function<F>&);
-        function(function<F>&&);
-
-        const unsigned long get_delay(bool microseconds = true) const;
-        void set_delay(unsigned long delay, bool microseconds = true);
+        channel(AsyncT& async) : m_async(async) {}
+        channel(const channel&)=delete;
 
-        const unsigned long getStep() const;
-        void setStep(unsigned long newSize); 
+        bool send(const T& value); //returns false if the channel is full
+        bool send(T&& value);
+        bool receive(T& value); //returns false if the channel is empty
 
-        const unsigned long getId() const;
-        void setId(unsigned long newId);
+        unsigned long wait_receive(); //returned by the receiver to park until something is sent
+        unsigned long wait_send(); //returned by a sender to park until something is received
 
-        void operator=(function<F>);
-        const bool operator==(const function<F>&) const;
-        
-        void swap(function<F>&);
-        
-        template<typename R, class ... Tn>
-        R run(Tn ... args) override;
+        const unsigned size() const { return m_tail - m_head; }
+        const bool empty() const { return m_tail == m_head; }
+        const bool full() const { return m_tail - m_head == Size; }
     private:
-        F m_func = nullptr; //sets the function to nullptr
-        unsigned long delay_time_us = 0; //amount of time needed to be delayed
-        unsigned long step = 1; //the number of steps it has done
-        unsigned long id = 0; //the id of the function; useful for functions that only want the latest version of itself to run
+        AsyncT& m_async;
+        T items[Size];
+        unsigned m_head = 0;
+        unsigned m_tail = 0;
+        park_slot m_receiver;
+        park_slot m_senders[Senders];
+};
+
+template <typename T, unsigned Size, typename AsyncT, int Senders>
+bool channel<T, Size, AsyncT, Senders>::send(const T& value) {
+    return send(T(value));
+}
+
+template <typename T, unsigned Size, typename AsyncT, int Senders>
+bool channel<T, Size, AsyncT, Senders>::send(T&& value) {
+    if (full())
+        return false;
+
+    items[m_tail++ & (Size - 1)] = _move(value);
+    m_async.wake(m_receiver);
+    return true;
+}
+
+template <typename T, unsigned Size, typename AsyncT, int Senders>
+bool channel<T, Size, AsyncT, Senders>::receive(T& value) {
+    if (empty())
+        return false;
+
+    value = _move(items[m_head++ & (Size - 1)]);
+    for (int iii = 0; iii < Senders; iii++) {
+        if (m_async.wake(m_senders[iii]))
+            break; //one value of room wakes one sender
+    }
+    return true;
+}
+
+template <typename T, unsigned Size, typename AsyncT, int Senders>
+unsigned long channel<T, Size, AsyncT, Senders>::wait_receive() {
+    if (!empty())
+        return m_async.yield_point(); //something arrived in the meantime
+    return m_async.park(m_receiver);
+}
+
+template <typename T, unsigned Size, typename AsyncT, int Senders>
+unsigned long channel<T, Size, AsyncT, Senders>::wait_send() {
+    if (!full())
+        return m_async.yield_point();
+
+    for (int iii = 0; iii < Senders; iii++) {
+        if (!m_senders[iii].waiting())
+            return m_async.park(m_senders[iii]);
+    }
+    return m_async.yield_point(); //every slot is taken
+}
+
+/*
+What event_bus does when a subscriber is too slow, and its queue is full when a sample is published.
+DROP_NEWEST: The subscriber misses the new sample.
+DROP_OLDEST: The subscriber misses the oldest sample in its queue, and gets the new one.
+*/
+enum bus_policy {
+    DROP_NEWEST = 0,
+    DROP_OLDEST
 };
 
 /**
- * Async structure. Async allows functions to run (almost) simultaneously.
- * Permanent functions: Permanent functions will remain on the async event loop forever.
- *                      This means that for every call to run_until_complete(), permanent functions will run.
- *                      The order in which permanent functions are added is the order the functions will run sequentially within the event loop
- * Normal functions: Normal functions will be removed from the event loop after a single call to run_until_complete()
- * Reason for not using shared pointers: Most likely never going to call getAll() or getAll_Permanent().
+ * Event bus. Publishes samples of T to every subscribed function without copying them: a sample is written once into a slot of
+ * a fixed pool, and every subscriber queues a pointer to that slot, which is counted, and reused once the last subscriber is
+ * done with it. Publishing wakes the subscribers that are parked, so they only run when there is something new:
+ *      int logger = bus.subscribe(DROP_OLDEST);
+ *      unsigned long log_samples(unsigned long step, unsigned long id) {
+ *          while (const sample* s = bus.next(logger)) log(*s); //the sample stays valid until the next call to next()
+ *          return bus.wait(logger);
+ *      }
+ * Every subscriber queues up to Depth samples; beyond that its bus_policy decides which sample it misses, so a slow subscriber
+ * never stalls the publisher. The default pool is large enough that publishing never fails.
  **/
-template <typename F>
-struct Async final {
-public:
-    Async();
-    ~Async();
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots = Subscribers * (Depth + 1) + 1>
+struct event_bus final {
+    public:
+        static_assert((Depth & (Depth - 1)) == 0, "the depth of a subscriber queue must be a power of 2");
+        static_assert(Slots <= 255, "slots are counted in bytes");
 
-    Async(const Async&)=delete;
-    Async(Async&&)=delete;
+        event_bus(AsyncT& async);
+        event_bus(const event_bus&)=delete;
 
-    void run_until_complete();
-    void offsetDelayBy(unsigned long offsetDelay); //offsets all the delay in the array
-    void add(function<F> fw); //adds a normal function
+        int subscribe(bus_policy policy = DROP_NEWEST); //returns the subscriber, or -1 if there are already Subscribers
+        bool publish(const T& sample); //returns false if every slot of the pool is in use
+        bool publish(T&& sample);
 
-    void remove(int index); //removes based on index
+        const T* next(int subscriber); //the next sample, or nullptr. Also lets go of the sample the last call returned
+        unsigned long wait(int subscriber); //returned by a subscriber to park until the next sample is published
+        const unsigned long dropped(int subscriber) const; //how many samples the subscriber missed
+    private:
+        struct subscriber_state {
+            unsigned char queue[Depth]; //slots of the pool
+            unsigned head = 0;
+            unsigned tail = 0;
+            int current = -1; //the slot the last next() returned
+            bus_policy policy = DROP_NEWEST;
+            unsigned long dropped = 0;
+            park_slot parked;
+        };
 
-    function<F> get(int index); //gets a function from the index
-    const function<F>* getAll() const; //gets all of the functions
+        AsyncT& m_async;
+        T m_samples[Slots];
+        unsigned char m_references[Slots] = {};
+        unsigned char m_free[Slots]; //a stack of unused slots
+        int m_free_count = Slots;
+        subscriber_state m_subscribers[Subscribers];
+        int m_subscribed = 0;
 
-    int size();
-    int max_size();
-    void sort(); //sorts the tasks list by selection sort based on delay time within the function.
-private:
-    int m_size              = 1; //at least the size of 1
-    int m_permsize          = 1; //size of permanent array
-    int curr_size           = 0; //the current size of the tasks
-    function<F> *tasks        = new function<F>[m_size]; //creates an array of functions with the size of 1
-    void allocate(int newSize);
-    void deallocate(int newSize);
+        void deliver(int slot); //queues a freshly written slot for every subscriber
+        void release(int slot);
 };
 
-/**Implementation for function**/
-template <typename F>
-function<F>::function(F func) {
-    m_func = func;
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+event_bus<T, Subscribers, Depth, AsyncT, Slots>::event_bus(AsyncT& async) : m_async(async) {
+    for (int iii = 0; iii < Slots; iii++)
+        m_free[iii] = iii;
 }
 
-template <typename F>
-function<F>::~function() {
-    m_func = nullptr; //makes m_func a null pointer. The function itself must continue to exist.
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+int event_bus<T, Subscribers, Depth, AsyncT, Slots>::subscribe(bus_policy policy) {
+    if (m_subscribed >= Subscribers)
+        return -1;
+
+    m_subscribers[m_subscribed].policy = policy;
+    return m_subscribed++;
 }
 
-template <typename F>
-function<F>::function(const function<F>& other) {
-    this->m_func = other.m_func;
-    this->delay_time_us = other.delay_time_us;
-    this->step = other.step;
-    this->id = other.id;
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+bool event_bus<T, Subscribers, Depth, AsyncT, Slots>::publish(const T& sample) {
+    if (m_free_count == 0)
+        return false;
+
+    int slot = m_free[--m_free_count];
+    m_samples[slot] = sample; //the only copy the sample ever goes through
+    deliver(slot);
+    return true;
 }
 
-template <typename F>
-function<F>::function(function<F>&& other) {
-    swap(other);
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+bool event_bus<T, Subscribers, Depth, AsyncT, Slots>::publish(T&& sample) {
+    if (m_free_count == 0)
+        return false;
+
+    int slot = m_free[--m_free_count];
+    m_samples[slot] = _move(sample);
+    deliver(slot);
+    return true;
 }
 
-template <typename F>
-const unsigned long function<F>::get_delay(bool microseconds) const {
-    if (microseconds)
-        return delay_time_us;
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+void event_bus<T, Subscribers, Depth, AsyncT, Slots>::deliver(int slot) {
+    m_references[slot] = 1; //held here until every subscriber has it queued
+
+    for (int iii = 0; iii < m_subscribed; iii++) {
+        subscriber_state& subscriber = m_subscribers[iii];
+        if (subscriber.tail - subscriber.head == Depth) {
+            subscriber.dropped++;
+            if (subscriber.policy == DROP_NEWEST)
+                continue;
+            release(subscriber.queue[subscriber.head++ & (Depth - 1)]);
+        }
+
+        subscriber.queue[subscriber.tail++ & (Depth - 1)] = slot;
+        m_references[slot]++;
+        m_async.wake(subscriber.parked);
+    }
 
-    return delay_time_us / 1000;
+    release(slot);
 }
 
-template <typename F>
-void function<F>::set_delay(unsigned long delay, bool microseconds) {
-    if (microseconds) {
-        delay_time_us = delay;
-        return;
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+const T* event_bus<T, Subscribers, Depth, AsyncT, Slots>::next(int subscriber) {
+    subscriber_state& state = m_subscribers[subscriber];
+    if (state.current >= 0) {
+        release(state.current);
+        state.current = -1;
     }
+    if (state.head == state.tail)
+        return nullptr;
 
-    delay_time_us = delay * 1000;
+    state.current = state.queue[state.head++ & (Depth - 1)];
+    return &m_samples[state.current];
 }
 
-template <typename F>
-const unsigned long function<F>::getStep() const {
-    return step;
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+unsigned long event_bus<T, Subscribers, Depth, AsyncT, Slots>::wait(int subscriber) {
+    subscriber_state& state = m_subscribers[subscriber];
+    if (state.head != state.tail)
+        return m_async.yield_point(); //something was published in the meantime
+    return m_async.park(state.parked);
 }
 
-template <typename F>
-void function<F>::setStep(unsigned long newSize) {
-    step = newSize;
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+const unsigned long event_bus<T, Subscribers, Depth, AsyncT, Slots>::dropped(int subscriber) const {
+    return m_subscribers[subscriber].dropped;
 }
 
-template <typename F>
-const unsigned long function<F>::getId() const {
-    return id;
+template <typename T, int Subscribers, unsigned Depth, typename AsyncT, int Slots>
+void event_bus<T, Subscribers, Depth, AsyncT, Slots>::release(int slot) {
+    if (--m_references[slot] == 0)
+        m_free[m_free_count++] = slot;
 }
 
-template <typename F>
-void function<F>::setId(unsigned long newId) {
-    id = newId;
+/**
+ * BitmapAsync. A heap-free Async for small, fixed task sets (at most 32 functions, and at most MAX_FUNCTIONARRAY_SIZE).
+ * Every function lives in a fixed slot, and the slot number is its priority: slot 0 runs first when several functions are due.
+ * Instead of sorting, each wake up flips every function whose delay ran out into a 32-bit ready mask in a single pass, and the
+ * mask is then drained lowest slot first, one count-trailing-zeros at a time.
+ **/
+template <typename F, typename Clock = ArduinoClock, typename Traits = task_traits>
+struct BitmapAsync final {
+public:
+    static const int SLOTS = MAX_FUNCTIONARRAY_SIZE < 32 ? MAX_FUNCTIONARRAY_SIZE : 32;
+
+    BitmapAsync()=default;
+    BitmapAsync(const BitmapAsync&)=delete;
+    BitmapAsync(BitmapAsync&&)=delete;
+
+    void run_until_complete();
+    int add(function<F, Traits> fw); //adds into the lowest free slot. Returns the slot, or -1 if every slot is taken
+    int add(function<F, Traits> fw, int slot); //adds into the given slot. Returns the slot, or -1 if it is taken or out of range
+    void remove(int slot);
+
+    function<F, Traits> get(int slot); //gets the function in a slot
+    int size();
+    int max_size();
+private:
+    function<F, Traits> tasks[SLOTS];
+    tick_t m_delays[SLOTS] = {}; //the delay of each slot, in ticks, relative to m_last
+    uint32_t m_used = 0; //a bit for every slot that holds a function
+    uint32_t m_ready = 0; //a bit for every slot that is due and has not run yet
+    timestamp m_last;
+};
+
+/**Implementation for BitmapAsync**/
+template <typename F, typename Clock, typename Traits>
+void BitmapAsync<F, Clock, Traits>::run_until_complete() {
+    m_last = Clock::now();
+    while (m_used) {
+        if (!m_ready) {
+            //A single pass charges the elapsed time, flips due slots into the mask, and finds the next deadline
+            timestamp now = Clock::now();
+            tick_t elapsed = now - m_last;
+            tick_t next = ~(tick_t)0;
+            m_last = now;
+
+            for (uint32_t bits = m_used; bits; bits &= bits - 1) {
+                int slot = __builtin_ctzl((unsigned long)bits);
+                if (m_delays[slot] <= elapsed) {
+                    m_delays[slot] = 0;
+                    m_ready |= (uint32_t)1 << slot;
+                }
+                else {
+                    m_delays[slot] -= elapsed;
+                    if (m_delays[slot] < next) next = m_delays[slot];
+                }
+            }
+
+            if (!m_ready) {
+                Clock::sleep(next);
+                continue;
+            }
+        }
+
+        int slot = __builtin_ctzl((unsigned long)m_ready); //the highest priority function that is due
+        m_ready &= m_ready - 1;
+
+        tick_t started = timestamp(Clock::now()) - m_last; //the slots drained before this one took time, which its delay must not lose
+        unsigned long returnValue = tasks[slot].template run<unsigned long>(tasks[slot].getStep(), tasks[slot].getId());
+        if (returnValue > 0) {
+            tick_t delay = microseconds(returnValue).ticks();
+            m_delays[slot] = delay < ~(tick_t)0 - started ? delay + started : ~(tick_t)0; //counts from when it started, relative to m_last
+            tasks[slot].setStep(tasks[slot].getStep() + 1); //increases the steps by 1
+        }
+        else remove(slot); //removes the function if the return value is 0
+    }
 }
 
-template <typename F>
-void function<F>::operator=(function<F> other) {
-    swap(other);
+template <typename F, typename Clock, typename Traits>
+int BitmapAsync<F, Clock, Traits>::add(function<F, Traits> fw) {
+    if (m_used == ~(uint32_t)0)
+        return -1;
+
+    return add(_move(fw), __builtin_ctzl((unsigned long)~m_used)); //the lowest free slot
 }
 
-template <typename F>
-const bool function<F>::operator==(const function<F>& other) const {
-    return (this->m_func == other.m_func && this->delay_time_us == other.delay_time_us && this->step == other.step && this->id == other.id);
+template <typename F, typename Clock, typename Traits>
+int BitmapAsync<F, Clock, Traits>::add(function<F, Traits> fw, int slot) {
+    if (slot < 0 || slot >= SLOTS || (m_used & ((uint32_t)1 << slot)))
+        return -1;
+
+    m_delays[slot] = fw.get_ticks();
+    tasks[slot] = _move(fw);
+    m_used |= (uint32_t)1 << slot;
+    return slot;
 }
 
-template <typename F>
-void function<F>::swap(function<F>& other) {
-    _swap(this->m_func, other.m_func);
-    _swap(this->step, other.step);
-    _swap(this->delay_time_us, other.delay_time_us);
-    _swap(this->id, other.id);
+template <typename F, typename Clock, typename Traits>
+void BitmapAsync<F, Clock, Traits>::remove(int slot) {
+    if (slot < 0 || slot >= SLOTS)
+        return;
+
+    m_used &= ~((uint32_t)1 << slot);
+    m_ready &= ~((uint32_t)1 << slot);
+    tasks[slot] = function<F, Traits>();
 }
 
-template <typename F>
-template <typename R, class ... Tn>
-R function<F>::run(Tn ... args) {
-    return m_func(args...); //calls the function with the parameters
+template <typename F, typename Clock, typename Traits>
+function<F, Traits> BitmapAsync<F, Clock, Traits>::get(int slot) {
+    function<F, Traits> fw = tasks[slot];
+    fw.set_ticks(m_delays[slot]);
+    return fw;
 }
 
-/**Implementation for Async**/
-template <typename F>
-Async<F>::Async() {
+template <typename F, typename Clock, typename Traits>
+int BitmapAsync<F, Clock, Traits>::size() {
+    return __builtin_popcountl((unsigned long)m_used);
+}
+
+template <typename F, typename Clock, typename Traits>
+int BitmapAsync<F, Clock, Traits>::max_size() {
+    return SLOTS;
+}
+
+#ifdef ASYNC_HAS_SHARDS
+/**
+ * SPSC ring. A bounded, lock-free queue between exactly one producer thread and one consumer thread. Size must be a power of 2.
+ * The head and tail are a cache line apart, so the two threads never write to the same line.
+ **/
+template <typename T, unsigned Size>
+struct spsc_ring final {
+    public:
+        static_assert((Size & (Size - 1)) == 0, "the size of a ring must be a power of 2");
+
+        bool push(T&& value); //returns false if the ring is full, and leaves value as it was
+        bool pop(T& value); //returns false if the ring is empty
+        const unsigned size() const;
+    private:
+        unsigned head = 0; //written by the consumer only
+        char m_pad0[64 - sizeof(unsigned)];
+        unsigned tail = 0; //written by the producer only
+        char m_pad1[64 - sizeof(unsigned)];
+        T items[Size];
+};
 
+template <typename T, unsigned Size>
+bool spsc_ring<T, Size>::push(T&& value) {
+    unsigned position = tail;
+    if (position - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= Size)
+        return false;
+
+    items[position & (Size - 1)] = _move(value);
+    __atomic_store_n(&tail, position + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
-template <typename F>
-Async<F>::~Async() {
+template <typename T, unsigned Size>
+bool spsc_ring<T, Size>::pop(T& value) {
+    unsigned position = head;
+    if (position == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+        return false;
 
+    value = _move(items[position & (Size - 1)]);
+    __atomic_store_n(&head, position + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
-template <>
-void Async<unsigned long(*)(unsigned long, unsigned long)>::run_until_complete() {
-    /* Starts the loop to complete the task list */
-    while (curr_size > 0) {
-        unsigned long begin = micros(); //gets the beginning time
-        unsigned long returnValue = tasks[0].run<unsigned long>(tasks[0].getStep(), tasks[0].getId());
-        if (returnValue > 0) {
-            tasks[0].set_delay(returnValue);
-            tasks[0].setStep(tasks[0].getStep() + 1); //increases the steps by 1
-        }
-        else remove(0); //removes the function if the return value is 0
-        this->sort();
+template <typename T, unsigned Size>
+const unsigned spsc_ring<T, Size>::size() const {
+    return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ShardClock. The clock policy of every shard of ShardedAsync: real time like HostClock, but sleeping also watches the inboxes
+ * of the shard, and wakes up early as soon as new functions arrive. Async re-reads the clock after every sleep, so waking up
+ * early is harmless.
+ **/
+struct ShardClock final {
+    static tick_t now() {
+        return HostClock::now();
+    }
 
-        if (curr_size == 0)
-            break; //exits the loop, our size is now zero, don't read from removed functions.
+    static void sleep(const tick_t time) {
+        const timestamp deadline = timestamp(now()) + time;
+        while (true) {
+            if (poller() && poller()(context()) > 0)
+                return; //new work arrived
+            if (timestamp(now()) >= deadline)
+                return;
 
-        //Determines if there still needs to be a delay to the next function
-        unsigned long time_spent = micros() - begin;
-        if (time_spent >= tasks[0].get_delay()) {
-            offsetDelayBy(time_spent); //offsets the delay
-            continue; //continues the loop
+            tick_t remaining = deadline - timestamp(now());
+            HostClock::sleep(remaining < 50 * ASYNC_TICKS_PER_US ? remaining : 50 * ASYNC_TICKS_PER_US);
         }
-        else wait(tasks[0].get_delay() - time_spent);
-        offsetDelayBy(tasks[0].get_delay() - time_spent); //sets all of the delays
     }
-}
 
-template <typename F>
-void Async<F>::offsetDelayBy(unsigned long offsetDelay) {
-    for (unsigned int iii = 0; iii < curr_size; iii++) {
-        if (tasks[iii].get_delay() >= offsetDelay) //checks if the delay can be subtracted without undesirable consequence (like overflowing).
-            tasks[iii].set_delay(tasks[iii].get_delay() - offsetDelay);
-        else tasks[iii].set_delay(0); //sets to zero otherwise.
+    static int (*&poller())(void*) { //drains the inboxes of the shard running on this thread, and returns how many functions arrived
+        static thread_local int (*poll)(void*) = nullptr;
+        return poll;
+    }
+
+    static void*& context() {
+        static thread_local void* shard = nullptr;
+        return shard;
+    }
+};
+
+/**
+ * ShardedAsync. One Async event loop per shard, each on its own thread pinned to its own core, sharing nothing but the rings
+ * between them. Every pair of shards has its own SPSC ring, plus one ring per shard for a single outside thread (for example
+ * main()), so nothing ever takes a lock.
+ *      submit(shard, fw): hands fw to a specific shard. From inside a shard it uses that shard's ring to the target.
+ *      submit(fw):        hands fw to the shard with the fewest functions.
+ *      submit(node):      starts a dag_node the same way. Every node after it is handed to the shard with the fewest functions
+ *                         once it is ready, so that independent branches run in parallel.
+ * Functions run on the shard's Async, so they can add() to it directly (ShardedAsync::current() gives it to them).
+ * stop() lets every shard finish its functions, including those still being handed between shards, and then joins the threads.
+ **/
+template <typename F, int Shards, unsigned RingSize = 64>
+struct ShardedAsync final {
+public:
+    ShardedAsync();
+    ~ShardedAsync();
+
+    ShardedAsync(const ShardedAsync&)=delete;
+    ShardedAsync(ShardedAsync&&)=delete;
+
+    void start();
+    void stop();
+
+    bool submit(int shard, function<F> fw); //returns false if the ring to the shard is full
+    bool submit(function<F> fw);
+    bool submit(dag_node<F>& node); //returns false if the ring to the shard is full; true if the node still waits for a predecessor
+    static bool release(function<F>&& fw, void* sharded); //the release hook of a dag_node that runs on sharded; takes fw only if it returns true
+
+    int load(int shard) const; //how many functions a shard has, including those still in its rings
+    static int shard(); //the shard the calling thread runs, or -1 outside of every shard
+    static Async<F, ShardClock>& current(); //the Async of the calling shard
+private:
+    struct shard_state {
+        Async<F, ShardClock> async;
+        pthread_t thread;
+        ShardedAsync* owner;
+        int index;
+        int size = 0; //published by the shard after every batch
+        int received = 0; //functions taken from the rings since the shard was last idle
+    };
+
+    typedef spsc_ring<function<F>, RingSize> ring;
+
+    shard_state m_shards[Shards];
+    ring* m_rings; //(Shards + 1) * Shards rings; ring from -> to lives at from * Shards + to, and from == Shards is the outside thread
+    bool m_running = false;
+    bool m_stopping = false;
+    int m_outstanding = 0; //functions submitted, and not yet finished by a shard that went idle
+
+    ring& route(int from, int to);
+    bool push(int shard, function<F>& fw); //moves fw into the ring to the shard, unless it is full
+    int least_loaded() const;
+    void hand_over(dag_node<F>& node); //releases every node after node onto the shards
+    static int poll(void* state); //drains every ring into a shard
+    static void* run(void* state); //the thread of a shard
+    static shard_state*& self();
+};
+
+template <typename F, int Shards, unsigned RingSize>
+ShardedAsync<F, Shards, RingSize>::ShardedAsync() {
+    m_rings = new ring[(Shards + 1) * Shards];
+    for (int iii = 0; iii < Shards; iii++) {
+        m_shards[iii].owner = this;
+        m_shards[iii].index = iii;
     }
 }
 
-template <typename F>
-void Async<F>::add(function<F> fw) {
-    if (curr_size >= MAX_FUNCTIONARRAY_SIZE)
-        return; //return. It's game over man, it's game over.
+template <typename F, int Shards, unsigned RingSize>
+ShardedAsync<F, Shards, RingSize>::~ShardedAsync() {
+    stop();
+    delete[] m_rings;
+}
 
-    if (curr_size >= m_size)
-        allocate(m_size * 2);
+template <typename F, int Shards, unsigned RingSize>
+void ShardedAsync<F, Shards, RingSize>::start() {
+    if (m_running)
+        return;
 
-    tasks[curr_size++] = fw; //adds the fucntion into the task list
+    m_running = true;
+    __atomic_store_n(&m_stopping, false, __ATOMIC_RELEASE);
+    for (int iii = 0; iii < Shards; iii++)
+        pthread_create(&m_shards[iii].thread, nullptr, &run, &m_shards[iii]);
 }
 
-template <typename F>
-void Async<F>::remove(int index) {
-    /* Invalid Parameter checking */
-    if (index >= curr_size)
-        return; //Arduinos can't throw exceptions;
+template <typename F, int Shards, unsigned RingSize>
+void ShardedAsync<F, Shards, RingSize>::stop() {
+    if (!m_running)
+        return;
 
-    if (index < 0)
-        return; //it needs work continuously!
-    
-    function<F> temp = tasks[curr_size - 1];
-    temp.swap(tasks[index]); //temp is now the object to delete
+    __atomic_store_n(&m_stopping, true, __ATOMIC_RELEASE);
+    for (int iii = 0; iii < Shards; iii++)
+        pthread_join(m_shards[iii].thread, nullptr);
+    m_running = false;
+}
 
-    temp.~function(); //calls the destructor for temporary
-    curr_size--; //decreases the size
-    this->sort();
+template <typename F, int Shards, unsigned RingSize>
+bool ShardedAsync<F, Shards, RingSize>::submit(int shard, function<F> fw) {
+    return push(shard, fw);
+}
 
-    if (curr_size < (m_size / 2)) deallocate(m_size / 2); //deallocates memory if not needed
+template <typename F, int Shards, unsigned RingSize>
+bool ShardedAsync<F, Shards, RingSize>::submit(function<F> fw) {
+    return push(least_loaded(), fw);
 }
 
-template <typename F>
-function<F> Async<F>::get(int index) {
-    if (index >= size)
-        return tasks[curr_size - 1];
+template <typename F, int Shards, unsigned RingSize>
+bool ShardedAsync<F, Shards, RingSize>::submit(dag_node<F>& node) {
+    hand_over(node);
+    if (node.pending() > 0)
+        return true; //the last predecessor to finish releases it
 
-    return tasks[index];
+    return push(least_loaded(), node.task);
 }
 
-template <typename F>
-const function<F>* Async<F>::getAll() const {
-    return tasks;
+template <typename F, int Shards, unsigned RingSize>
+bool ShardedAsync<F, Shards, RingSize>::release(function<F>&& fw, void* sharded) {
+    ShardedAsync* owner = (ShardedAsync*)sharded;
+    return owner->push(owner->least_loaded(), fw);
 }
 
-template <typename F>
-int Async<F>::max_size() {
-    return m_size;
+template <typename F, int Shards, unsigned RingSize>
+void ShardedAsync<F, Shards, RingSize>::hand_over(dag_node<F>& node) {
+    for (int iii = 0; iii < node.m_successors; iii++) {
+        dag_node<F>* next = node.successors[iii];
+        if (next->release == &release && next->context == this)
+            continue; //reached through another path already
+
+        next->set_release(&release, this);
+        hand_over(*next);
+    }
 }
 
-template <typename F>
-int Async<F>::size() {
-    return curr_size;
+template <typename F, int Shards, unsigned RingSize>
+bool ShardedAsync<F, Shards, RingSize>::push(int shard, function<F>& fw) {
+    if (shard < 0 || shard >= Shards)
+        return false;
+
+    int from = self() && self()->owner == this ? self()->index : Shards;
+    __atomic_add_fetch(&m_outstanding, 1, __ATOMIC_ACQ_REL); //before the push, so the count never drops to 0 while fw is in flight
+    if (route(from, shard).push(_move(fw)))
+        return true;
+
+    __atomic_sub_fetch(&m_outstanding, 1, __ATOMIC_ACQ_REL);
+    return false;
 }
 
-template <typename F>
-void Async<F>::allocate(int newSize) {
-    function<F> *newTasks = new function<F>[newSize];
-    if (newSize > m_size) {
-        for (unsigned int iii = 0; iii < curr_size; iii++) {
-            newTasks[iii] = tasks[iii];
+template <typename F, int Shards, unsigned RingSize>
+int ShardedAsync<F, Shards, RingSize>::least_loaded() const {
+    int best = 0;
+    int bestLoad = load(0);
+    for (int iii = 1; iii < Shards && bestLoad > 0; iii++) {
+        int shardLoad = load(iii);
+        if (shardLoad < bestLoad) {
+            best = iii;
+            bestLoad = shardLoad;
         }
     }
-    delete[] tasks; //delete tasks
-    tasks = newTasks;
-    m_size = newSize;
+    return best;
 }
 
-template <typename F>
-void Async<F>::deallocate(int newSize) {
-    function<F> *newTasks = new function<F>[newSize];
-    for (unsigned int iii = 0; iii < newSize; iii++) {
-        newTasks[iii] = tasks[iii];
+template <typename F, int Shards, unsigned RingSize>
+int ShardedAsync<F, Shards, RingSize>::load(int shard) const {
+    int total = __atomic_load_n(&m_shards[shard].size, __ATOMIC_RELAXED);
+    for (int from = 0; from <= Shards; from++)
+        total += m_rings[from * Shards + shard].size();
+    return total;
+}
+
+template <typename F, int Shards, unsigned RingSize>
+int ShardedAsync<F, Shards, RingSize>::shard() {
+    return self() ? self()->index : -1;
+}
+
+template <typename F, int Shards, unsigned RingSize>
+Async<F, ShardClock>& ShardedAsync<F, Shards, RingSize>::current() {
+    return self()->async;
+}
+
+template <typename F, int Shards, unsigned RingSize>
+typename ShardedAsync<F, Shards, RingSize>::ring& ShardedAsync<F, Shards, RingSize>::route(int from, int to) {
+    return m_rings[from * Shards + to];
+}
+
+template <typename F, int Shards, unsigned RingSize>
+int ShardedAsync<F, Shards, RingSize>::poll(void* state) {
+    shard_state* shard = (shard_state*)state;
+    int arrived = 0;
+    function<F> fw;
+    for (int from = 0; from <= Shards; from++) {
+        while (!shard->async.full() && shard->owner->route(from, shard->index).pop(fw)) { //the rest waits in the ring
+            shard->async.add(_move(fw));
+            arrived++;
+        }
     }
-    delete[] tasks; //delete tasks
-    tasks = newTasks;
-    m_size = newSize;
+    shard->received += arrived;
+    __atomic_store_n(&shard->size, shard->async.size(), __ATOMIC_RELAXED);
+    return arrived;
 }
 
-template <typename F>
-void Async<F>::sort() {
-    unsigned int smallestIndex = 0;
-    
-    //Don't sort if the size is 0. The index used is unsigned int, so curr_size - 1 will never be achieved.
-    if (curr_size == 0)
-        return;
+template <typename F, int Shards, unsigned RingSize>
+void* ShardedAsync<F, Shards, RingSize>::run(void* state) {
+    shard_state* shard = (shard_state*)state;
+    self() = shard;
+    ShardClock::poller() = &poll;
+    ShardClock::context() = shard;
 
-    //Selection Sort implementation
-    for (unsigned int currentIndex = 0; currentIndex < curr_size - 1; currentIndex++) {
-        for (unsigned int iii = currentIndex; iii < curr_size; iii++) {
-            if (tasks[iii].get_delay() < tasks[smallestIndex].get_delay())
-                smallestIndex = iii;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->index % (cores > 0 ? cores : 1), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    while (true) {
+        poll(shard);
+        if (shard->async.until_next() != ~(tick_t)0) { //something waits for time; parked functions only run once another function wakes them
+            shard->async.run_until_complete(); //returns once nothing is left but parked functions
+            __atomic_store_n(&shard->size, shard->async.size(), __ATOMIC_RELAXED);
+            continue;
         }
 
-        if (currentIndex != smallestIndex)
-            tasks[currentIndex].swap(tasks[smallestIndex]); //swaps the two
+        if (shard->received > 0) { //everything received so far has finished or parked, including whatever it submitted
+            __atomic_sub_fetch(&shard->owner->m_outstanding, shard->received, __ATOMIC_ACQ_REL);
+            shard->received = 0;
+        }
+        if (__atomic_load_n(&shard->owner->m_stopping, __ATOMIC_ACQUIRE) && __atomic_load_n(&shard->owner->m_outstanding, __ATOMIC_ACQUIRE) == 0)
+            break; //no shard has anything left to do, so nothing can wake the parked functions either
+        ShardClock::sleep(50 * ASYNC_TICKS_PER_US); //returns early once new functions arrive
     }
+
+    self() = nullptr;
+    return nullptr;
+}
+
+template <typename F, int Shards, unsigned RingSize>
+typename ShardedAsync<F, Shards, RingSize>::shard_state*& ShardedAsync<F, Shards, RingSize>::self() {
+    static thread_local shard_state* shard = nullptr;
+    return shard;
 }
+#endif
 
 #endif
\ No newline at end of file